@@ -1,16 +1,617 @@
 #include "cache.h"
+#include "httputil.h"
+#include "lz.h"
 
-/// you can use any data structures like linked-list, tree and hash table
-int cache_size = 0;
-cache_block *start = NULL;
+/// blocks live in a doubly linked list per cache; the replacement policy
+/// decides which one is evicted when the cache is full
+/// blocks are reference counted: an evicted block that a reader still
+/// holds is unlinked at once but freed when the reader releases it
+/// a body shared by several blocks counts once against the cache size
+/// and leaves the cache with the last block using it
+/// with compress set, text bodies are kept lz-compressed and count with
+/// their compressed length; hits are expanded by cache_expand
 
-// find cache block with uri, return NULL if none
-cache_block *find_cache_block(char *uri)
+static char *policy_names[] = {"fifo", "lru", "lfu", "gdsf"};
+
+/// a block in a snapshot: this header, then the uri and the response
+/// header with their terminating NULs, then the body, padded to 8 bytes
+typedef struct {
+  int uriLength;
+  int respLength;
+  int contentLength;
+  int offset;
+  int totalLength;
+  int frequency;
+  time_t expires;
+} snapshot_record;
+
+#define RECORD_SIZE(uriLength, respLength, contentLength) \
+  ((sizeof(snapshot_record) + (uriLength) + (respLength) + 2 + (contentLength) + 7) & ~7L)
+
+void cache_init(cache_t *cache, int policy, int maxCacheSize, int maxObjectSize)
+{
+  /*
+ * cache_init: 
+ *        initialize an empty cache
+ * params:
+ *    - cache: the cache
+ *    - policy: replacement policy (POLICY_FIFO, ...)
+ *    - maxCacheSize: capacity in bytes, block headers included
+ *    - maxObjectSize: largest block that is cached
+ * 
+ */
+  (*cache).start = NULL;
+  (*cache).end = NULL;
+  (*cache).cache_size = 0;
+  (*cache).max_cache_size = maxCacheSize;
+  (*cache).max_object_size = maxObjectSize;
+  (*cache).policy = policy;
+  (*cache).inflation = 0;
+  (*cache).dedup = 1;
+  (*cache).compress = 0;
+  memset((*cache).blobs, 0, sizeof((*cache).blobs));
+  (*cache).hits = 0;
+  (*cache).misses = 0;
+  memset(&(*cache).mrc, 0, sizeof(mrc_t));
+}
+
+// free every block of the cache
+void cache_free(cache_t *cache)
 {
-  cache_block *ptr = start;
+  cache_block *ptr = (*cache).start, *next;
   while (ptr != NULL)
   {
-    if (strcmp(uri, (*ptr).uri) == 0)
+    next = (*ptr).next;
+    cache_release(ptr);
+    ptr = next;
+  }
+  (*cache).start = NULL;
+  (*cache).end = NULL;
+  (*cache).cache_size = 0;
+  (*cache).inflation = 0;
+  memset((*cache).blobs, 0, sizeof((*cache).blobs));
+
+  mrc_object *obj = (*cache).mrc.top, *nextObj;
+  while (obj != NULL)
+  {
+    nextObj = (*obj).next;
+    free(obj);
+    obj = nextObj;
+  }
+  free((*cache).mrc.index);
+  free((*cache).mrc.tree);
+  memset(&(*cache).mrc, 0, sizeof(mrc_t));
+}
+
+// policy number of a name like "lru", -1 if unknown
+int cache_policy(char *name)
+{
+  int i;
+  for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+  {
+    if (strcasecmp(name, policy_names[i]) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+char *cache_policy_name(int policy)
+{
+  return policy_names[policy];
+}
+
+static void unlink_block(cache_t *cache, cache_block *ptr)
+{
+  if ((*ptr).prev != NULL)
+    (*(*ptr).prev).next = (*ptr).next;
+  else
+    (*cache).start = (*ptr).next;
+  if ((*ptr).next != NULL)
+    (*(*ptr).next).prev = (*ptr).prev;
+  else
+    (*cache).end = (*ptr).prev;
+}
+
+static void append_block(cache_t *cache, cache_block *ptr)
+{
+  (*ptr).prev = (*cache).end;
+  (*ptr).next = NULL;
+  if ((*cache).end != NULL)
+    (*(*cache).end).next = ptr;
+  else
+    (*cache).start = ptr;
+  (*cache).end = ptr;
+}
+
+// FNV-1a hash of a body
+static unsigned long long hash_body(char *content, int length)
+{
+  unsigned long long h = 14695981039346656037ull;
+  int i;
+  for (i = 0; i < length; i++)
+  {
+    h ^= (unsigned char)content[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// the blob of the cache holding exactly these bytes, NULL if none
+static cache_blob *find_blob(cache_t *cache, unsigned long long hash, char *content, int length)
+{
+  cache_blob *blob;
+  for (blob = (*cache).blobs[hash % BLOB_BUCKETS]; blob != NULL; blob = (*blob).next)
+  {
+    if ((*blob).hash == hash && (*blob).length == length &&
+        memcmp((*blob).data, content, length) == 0)
+    {
+      return blob;
+    }
+  }
+  return NULL;
+}
+
+// a new blob with a copy of content, indexed in the cache
+static cache_blob *add_blob(cache_t *cache, unsigned long long hash, char *content, int length)
+{
+  cache_blob *blob = malloc(sizeof(cache_blob) + length);
+  cache_blob **bucket = &(*cache).blobs[hash % BLOB_BUCKETS];
+
+  (*blob).hash = hash;
+  (*blob).length = length;
+  (*blob).cached = 0;
+  (*blob).refs = 0;
+  memcpy((*blob).data, content, length);
+  (*blob).next = *bucket;
+  *bucket = blob;
+  return blob;
+}
+
+// take a blob no cached block uses out of the index
+static void remove_blob(cache_t *cache, cache_blob *blob)
+{
+  cache_blob **p = &(*cache).blobs[(*blob).hash % BLOB_BUCKETS];
+  while (*p != blob)
+    p = &(**p).next;
+  *p = (*blob).next;
+}
+
+// bytes of the body as it is kept in memory
+static int stored_length(cache_block *ptr)
+{
+  return (*ptr).compressedLength ? (*ptr).compressedLength : (*ptr).contentLength;
+}
+
+// take a block out of the cache; it is freed once no reader holds it
+static void free_block(cache_t *cache, cache_block *ptr)
+{
+  cache_blob *blob = (*ptr).blob;
+
+  unlink_block(cache, ptr);
+  (*cache).cache_size -= sizeof(cache_block);
+  if (blob == NULL)
+  {
+    (*cache).cache_size -= stored_length(ptr);
+  }
+  else if (--(*blob).cached == 0)
+  {
+    remove_blob(cache, blob);
+    (*cache).cache_size -= (*blob).length;
+  }
+  cache_release(ptr);
+}
+
+// keep a block found under the cache lock alive after the lock is
+// released, e.g. while it is sent to a client
+void cache_hold(cache_block *ptr)
+{
+  __atomic_fetch_add(&(*ptr).refs, 1, __ATOMIC_RELAXED);
+}
+
+// drop a reference to a block without taking the cache lock; the last
+// one (a reader's, or the cache's on eviction) frees the block
+void cache_release(cache_block *ptr)
+{
+  cache_blob *blob = (*ptr).blob;
+
+  if (__atomic_sub_fetch(&(*ptr).refs, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    if (blob == NULL)
+      free((*ptr).content);
+    else if (__atomic_sub_fetch(&(*blob).refs, 1, __ATOMIC_ACQ_REL) == 0)
+      free(blob);
+    free(ptr);
+  }
+}
+
+// a block whose body can be sent as is: a compressed block is expanded
+// into a private copy (released like any block) and the reference to it
+// is dropped; NULL if it could not be expanded. Needs no cache lock.
+cache_block *cache_expand(cache_block *ptr)
+{
+  cache_block *copy;
+
+  if ((*ptr).compressedLength == 0)
+    return ptr;
+  copy = malloc(sizeof(cache_block));
+  memcpy(copy, ptr, sizeof(cache_block));
+  (*copy).content = malloc((*ptr).contentLength + 1);
+  (*copy).blob = NULL;
+  (*copy).compressedLength = 0;
+  (*copy).refs = 1;
+  (*copy).prev = (*copy).next = NULL;
+  if (lz_decompress((*ptr).content, (*ptr).compressedLength, (*copy).content,
+                    (*ptr).contentLength) != (*ptr).contentLength)
+  {
+    cache_release(copy);
+    copy = NULL;
+  }
+  cache_release(ptr);
+  return copy;
+}
+
+// GDSF priority of a block: inflation + frequency / size
+static double gdsf_priority(cache_t *cache, cache_block *ptr)
+{
+  return (*cache).inflation + (double)(*ptr).frequency / (sizeof(cache_block) + stored_length(ptr));
+}
+
+// update the policy state of a block that served a request
+static void touch_block(cache_t *cache, cache_block *ptr)
+{
+  (*ptr).frequency++;
+  if ((*cache).policy == POLICY_LRU)
+  {
+    unlink_block(cache, ptr);
+    append_block(cache, ptr);
+  }
+  else if ((*cache).policy == POLICY_GDSF)
+  {
+    (*ptr).priority = gdsf_priority(cache, ptr);
+  }
+}
+
+// 64-bit FNV-1a hash of a URI
+static unsigned long long hash_uri(char *uri)
+{
+  unsigned long long h = 14695981039346656037ull;
+  while (*uri)
+  {
+    h ^= (unsigned char)*uri++;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// which of n cache shards holds uri
+int cache_shard(char *uri, int n)
+{
+  return hash_uri(uri) % n;
+}
+
+// is the URI with this hash in the MRC sample; the hash is remixed first
+// since URIs differing only in their last bytes share the FNV high bits
+static int mrc_sampled(unsigned long long key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  return (key & 0xffffff) < (unsigned long long)(MRC_SAMPLE_RATE * 0x1000000);
+}
+
+static void mrc_unlink(mrc_t *mrc, mrc_object *obj)
+{
+  if ((*obj).prev != NULL)
+    (*(*obj).prev).next = (*obj).next;
+  else
+    (*mrc).top = (*obj).next;
+  if ((*obj).next != NULL)
+    (*(*obj).next).prev = (*obj).prev;
+  else
+    (*mrc).bottom = (*obj).prev;
+}
+
+static void mrc_push(mrc_t *mrc, mrc_object *obj)
+{
+  (*obj).prev = NULL;
+  (*obj).next = (*mrc).top;
+  if ((*mrc).top != NULL)
+    (*(*mrc).top).prev = obj;
+  else
+    (*mrc).bottom = obj;
+  (*mrc).top = obj;
+}
+
+// add delta to the size at reference time i of the Fenwick tree
+static void mrc_tree_add(mrc_t *mrc, int i, long delta)
+{
+  for (; i <= MRC_TIMES; i += i & -i)
+    (*mrc).tree[i] += delta;
+}
+
+// sum of the sizes at reference times 1..i
+static long mrc_tree_sum(mrc_t *mrc, int i)
+{
+  long sum = 0;
+  for (; i > 0; i -= i & -i)
+    sum += (*mrc).tree[i];
+  return sum;
+}
+
+// the bytes an object adds to the distance of the objects below it
+static int mrc_weight(mrc_object *obj)
+{
+  return (*obj).size > 0 ? (*obj).size : 0;
+}
+
+// the sampled object with this key, NULL if it is not in the stack
+static mrc_object *mrc_find(mrc_t *mrc, unsigned long long key)
+{
+  mrc_object *obj;
+
+  if ((*mrc).index == NULL)
+    return NULL;
+  for (obj = (*mrc).index[key & (MRC_HASH - 1)]; obj != NULL; obj = (*obj).hnext)
+    if ((*obj).key == key)
+      return obj;
+  return NULL;
+}
+
+static void mrc_unindex(mrc_t *mrc, mrc_object *obj)
+{
+  mrc_object **p = &(*mrc).index[(*obj).key & (MRC_HASH - 1)];
+  while (*p != obj)
+    p = &(**p).hnext;
+  *p = (*obj).hnext;
+}
+
+// give the object at the top of the stack the next reference time; when
+// the times run out, the stack is renumbered from the bottom up
+static void mrc_stamp(mrc_t *mrc, mrc_object *obj)
+{
+  mrc_object *p;
+
+  if ((*mrc).now < MRC_TIMES)
+  {
+    (*obj).time = ++(*mrc).now;
+    mrc_tree_add(mrc, (*obj).time, mrc_weight(obj));
+    return;
+  }
+  memset((*mrc).tree, 0, (MRC_TIMES + 1) * sizeof(long));
+  (*mrc).now = 0;
+  for (p = (*mrc).bottom; p != NULL; p = (*p).prev)
+  {
+    (*p).time = ++(*mrc).now;
+    mrc_tree_add(mrc, (*p).time, mrc_weight(p));
+  }
+}
+
+// record a lookup of a sampled URI: its reuse distance is the size of the
+// distinct objects referenced since its last lookup plus its own size
+static void mrc_reference(mrc_t *mrc, unsigned long long key)
+{
+  mrc_object *obj;
+  long distance;
+
+  if ((*mrc).index == NULL)
+  {
+    (*mrc).index = calloc(MRC_HASH, sizeof(mrc_object *));
+    (*mrc).tree = calloc(MRC_TIMES + 1, sizeof(long));
+  }
+  (*mrc).samples++;
+
+  if ((obj = mrc_find(mrc, key)) == NULL)
+  {
+    (*mrc).cold++;
+    if ((*mrc).objects == MRC_MAX_OBJECTS)
+    {
+      obj = (*mrc).bottom;
+      mrc_unlink(mrc, obj);
+      mrc_unindex(mrc, obj);
+      mrc_tree_add(mrc, (*obj).time, -mrc_weight(obj));
+    }
+    else
+    {
+      obj = malloc(sizeof(mrc_object));
+      (*mrc).objects++;
+    }
+    (*obj).key = key;
+    (*obj).size = 0;
+    (*obj).hnext = (*mrc).index[key & (MRC_HASH - 1)];
+    (*mrc).index[key & (MRC_HASH - 1)] = obj;
+  }
+  else
+  {
+    distance = mrc_tree_sum(mrc, (*mrc).now) - mrc_tree_sum(mrc, (*obj).time);
+    long bucket = (long)((distance + (*obj).size) / MRC_SAMPLE_RATE) / MRC_BUCKET;
+    if ((*obj).size < 0 || bucket >= MRC_BUCKETS)
+      (*mrc).beyond++;
+    else
+      (*mrc).histogram[bucket]++;
+    mrc_tree_add(mrc, (*obj).time, -mrc_weight(obj));
+    mrc_unlink(mrc, obj);
+  }
+  mrc_push(mrc, obj);
+  mrc_stamp(mrc, obj);
+}
+
+void cache_object_size(cache_t *cache, char *uri, int size)
+{
+  /*
+ * cache_object_size: 
+ *        tell the miss ratio curve estimator the size of an object once it
+ *        is known (after a miss was fetched)
+ * params:
+ *    - cache: the cache
+ *    - uri: uri string
+ *    - size: length of the object; objects larger than the object size
+ *        limit never hit, whatever the cache size
+ */
+  unsigned long long key = hash_uri(uri);
+  mrc_t *mrc = &(*cache).mrc;
+  mrc_object *obj;
+
+  if (!mrc_sampled(key) || (obj = mrc_find(mrc, key)) == NULL)
+    return;
+  mrc_tree_add(mrc, (*obj).time, -mrc_weight(obj));
+  (*obj).size = sizeof(cache_block) + size > (*cache).max_object_size ? -1 : size;
+  mrc_tree_add(mrc, (*obj).time, mrc_weight(obj));
+}
+
+double cache_estimate_miss_ratio(cache_t *cache, long size)
+{
+  /*
+ * cache_estimate_miss_ratio: 
+ *        estimated miss ratio of complete-object lookups if the cache had
+ *        the given capacity, read from the sampled reuse distances
+ * params:
+ *    - cache: the cache
+ *    - size: cache capacity in bytes
+ */
+  mrc_t *mrc = &(*cache).mrc;
+  long hits = 0;
+  int i;
+
+  if ((*mrc).samples == 0)
+    return 1;
+  for (i = 0; i < MRC_BUCKETS && (long)(i + 1) * MRC_BUCKET <= size; i++)
+    hits += (*mrc).histogram[i];
+  return 1 - (double)hits / (*mrc).samples;
+}
+
+int cache_stats(cache_t *cache, char *buf, int size)
+{
+  /*
+ * cache_stats: 
+ *        write a plain text report of the cache: occupancy, hit ratio and
+ *        the estimated miss ratio curve
+ * params:
+ *    - cache: the cache
+ *    - buf: output buffer
+ *    - size: size of buf
+ * return: length of the report
+ */
+  mrc_t *mrc = &(*cache).mrc;
+  long lookups = (*cache).hits + (*cache).misses;
+  int n, last = -1, i, blocks = 0, blobs = 0, compressed = 0;
+  long bodies = 0, stored = 0, packed = 0, unpacked = 0;
+  cache_block *ptr;
+  cache_blob *blob;
+
+  for (ptr = (*cache).start; ptr != NULL; ptr = (*ptr).next)
+  {
+    blocks++;
+    bodies += stored_length(ptr);
+    if ((*ptr).compressedLength)
+    {
+      compressed++;
+      unpacked += (*ptr).contentLength;
+      packed += (*ptr).compressedLength;
+    }
+  }
+  for (i = 0; i < BLOB_BUCKETS; i++)
+    for (blob = (*cache).blobs[i]; blob != NULL; blob = (*blob).next)
+    {
+      blobs++;
+      stored += (*blob).length;
+    }
+  for (i = 0; i < MRC_BUCKETS; i++)
+    if ((*mrc).histogram[i])
+      last = i;
+
+  n = snprintf(buf, size,
+               "policy %s\n"
+               "size %d of %d bytes in %d blocks (objects up to %d bytes)\n"
+               "hits %ld misses %ld hit ratio %.4f\n"
+               "%d distinct bodies, %ld bytes saved by sharing identical ones\n"
+               "%d bodies compressed from %ld to %ld bytes\n"
+               "\n"
+               "miss ratio curve (SHARDS, sampling rate %g, %ld sampled lookups)\n"
+               "estimated miss ratio at 1x %.4f 2x %.4f 4x %.4f the cache size\n"
+               "%12s %12s\n",
+               cache_policy_name((*cache).policy),
+               (*cache).cache_size, (*cache).max_cache_size, blocks, (*cache).max_object_size,
+               (*cache).hits, (*cache).misses, lookups ? (double)(*cache).hits / lookups : 0,
+               blobs, (*cache).dedup ? bodies - stored : 0,
+               compressed, unpacked, packed,
+               MRC_SAMPLE_RATE, (*mrc).samples,
+               cache_estimate_miss_ratio(cache, (*cache).max_cache_size),
+               cache_estimate_miss_ratio(cache, 2L * (*cache).max_cache_size),
+               cache_estimate_miss_ratio(cache, 4L * (*cache).max_cache_size),
+               "cache bytes", "miss ratio");
+  for (i = 0; i <= last + 1 && i < MRC_BUCKETS && n < size; i++)
+  {
+    n += snprintf(buf + n, size - n, "%12ld %12.4f\n", (long)(i + 1) * MRC_BUCKET,
+                  cache_estimate_miss_ratio(cache, (long)(i + 1) * MRC_BUCKET));
+  }
+  return n < size ? n : size - 1;
+}
+
+// can a client with the given Accept-Encoding take this block
+static int variant_matches(cache_block *ptr, int acceptGzip)
+{
+  if (acceptGzip)
+  {
+    return (*ptr).gzip || !(*ptr).vary;
+  }
+  return !(*ptr).gzip;
+}
+
+// drop the block if it is an error response past its expiry
+static int expired(cache_t *cache, cache_block *ptr)
+{
+  if ((*ptr).expires == 0 || time(NULL) < (*ptr).expires)
+  {
+    return 0;
+  }
+  free_block(cache, ptr);
+  return 1;
+}
+
+// find the complete cache block of uri, return NULL if none
+// every lookup is counted, and sampled ones feed the miss ratio curve
+// an error response of uri is a complete block until it expires
+cache_block *find_cache_block(cache_t *cache, char *uri, int acceptGzip)
+{
+  unsigned long long key = hash_uri(uri);
+  if (mrc_sampled(key))
+  {
+    mrc_reference(&(*cache).mrc, key);
+  }
+
+  cache_block *ptr = (*cache).start, *next;
+  while (ptr != NULL)
+  {
+    next = (*ptr).next;
+    if (strcmp(uri, (*ptr).uri) == 0 && (*ptr).contentLength == (*ptr).totalLength &&
+        variant_matches(ptr, acceptGzip))
+    {
+      if (expired(cache, ptr))
+      {
+        ptr = next;
+        continue;
+      }
+      touch_block(cache, ptr);
+      (*cache).hits++;
+      return ptr;
+    }
+    ptr = next;
+  }
+  (*cache).misses++;
+  return NULL;
+}
+
+// find any cache block of uri, complete or partial, return NULL if none
+// (error responses do not answer Range requests)
+cache_block *find_cache_any(cache_t *cache, char *uri, int acceptGzip)
+{
+  cache_block *ptr = (*cache).start;
+  while (ptr != NULL)
+  {
+    if (strcmp(uri, (*ptr).uri) == 0 && variant_matches(ptr, acceptGzip) &&
+        (*ptr).expires == 0)
     {
       return ptr;
     }
@@ -19,82 +620,308 @@ cache_block *find_cache_block(char *uri)
   return NULL;
 }
 
-void cache_replacement_policy()
+// find a cache block of uri with the given encoding holding bytes
+// first..last, return NULL if none
+cache_block *find_cache_range(cache_t *cache, char *uri, int gzip, int first, int last)
+{
+  cache_block *ptr = (*cache).start;
+  while (ptr != NULL)
+  {
+    if (strcmp(uri, (*ptr).uri) == 0 && (*ptr).gzip == gzip && (*ptr).expires == 0 &&
+        (*ptr).offset <= first && last < (*ptr).offset + (*ptr).contentLength)
+    {
+      touch_block(cache, ptr);
+      return ptr;
+    }
+    ptr = (*ptr).next;
+  }
+  return NULL;
+}
+
+// take a block found by a lookup out of the cache, e.g. because the
+// object changed; readers holding it keep it until they release it
+void remove_cache_block(cache_t *cache, cache_block *ptr)
+{
+  free_block(cache, ptr);
+}
+
+// unlink and free every partial block of uri with the given encoding
+static void remove_partial_blocks(cache_t *cache, char *uri, int gzip)
+{
+  cache_block *ptr = (*cache).start, *next;
+  while (ptr != NULL)
+  {
+    next = (*ptr).next;
+    if (strcmp(uri, (*ptr).uri) == 0 && (*ptr).gzip == gzip &&
+        (*ptr).contentLength != (*ptr).totalLength)
+    {
+      free_block(cache, ptr);
+    }
+    ptr = next;
+  }
+}
+
+void cache_replacement_policy(cache_t *cache)
 {
   /*
  * cache_replacement_policy: 
  * 			delete the cached contents according to the cache replacement policy
  * params:
+ *    - cache: the cache
  *
+ * FIFO and LRU evict from the start of the list (the oldest insertion or
+ * the least recent use). LFU and GDSF evict the block with the smallest
+ * frequency or priority, the oldest one on ties.
  */
 
   // if the cache is too big, free some blocks
-  cache_block *oldstart = start;
-  while (cache_size > MAX_CACHE_SIZE)
+  while ((*cache).cache_size > (*cache).max_cache_size)
   {
-    start = (*start).next;
+    cache_block *victim = (*cache).start, *ptr;
 
-    int freeSize = sizeof(cache_block) + (*oldstart).contentLength;
-    cache_size -= freeSize;
-
-    free((*oldstart).content);
-    free(oldstart);
+    if ((*cache).policy == POLICY_LFU || (*cache).policy == POLICY_GDSF)
+    {
+      for (ptr = (*cache).start; ptr != NULL; ptr = (*ptr).next)
+      {
+        if ((*cache).policy == POLICY_LFU ? (*ptr).frequency < (*victim).frequency
+                                          : (*ptr).priority < (*victim).priority)
+        {
+          victim = ptr;
+        }
+      }
+      if ((*cache).policy == POLICY_GDSF)
+      {
+        (*cache).inflation = (*victim).priority;
+      }
+    }
 
-    oldstart = start;
+    free_block(cache, victim);
   }
 }
 
-int add_cache_block(char *uri, char *content, char *response, int contentLength)
+// add a block expiring at expires (0: never) that was used frequency
+// times, see add_cache_block
+static int insert_block(cache_t *cache, char *uri, char *content, char *response,
+                        int contentLength, int offset, int totalLength, time_t expires,
+                        int frequency)
 {
-  /*
- * add_cache_block: 
- *        add the uri information into the proxy cache 
- * params:
- *    - uri: uri string.
- *    - content: the content of uri
- *    - response: response header 
- *    - contentLength: byte length of the HTTP body
- * 
- */
   /// use cache replacement policy if the proxy cache is full.
-  /// you can use any cache replacement policy such as FIFO, LRU
 
   int newSize = sizeof(cache_block) + contentLength;
 
   // too big!!
-  if (newSize > MAX_OBJECT_SIZE)
+  if (newSize > (*cache).max_object_size || strlen(uri) >= URI_SIZE ||
+      strlen(response) >= RESP_SIZE)
   {
     return 0;
   }
 
-  cache_block *ptr = start;
-  cache_block *backPtr;
-  while (ptr != NULL)
+  // the encoding of the body decides which clients the block can serve
+  char gzip = header_has_token(response, "Content-Encoding:", "gzip");
+  char vary = header_has_token(response, "Vary:", "Accept-Encoding");
+
+  // a complete object makes the partial blocks of the same uri redundant
+  if (contentLength == totalLength)
   {
-    backPtr = ptr;
-    ptr = (*ptr).next;
+    remove_partial_blocks(cache, uri, gzip);
   }
-  ptr = malloc(sizeof(cache_block));
 
-  strcpy((*ptr).uri, uri);
-  strcpy((*ptr).resp, response);
-  (*ptr).content = malloc(sizeof(char) * contentLength);
-  memcpy((*ptr).content, content, contentLength);
-  (*ptr).contentLength = contentLength;
-  (*ptr).next = NULL;
+  cache_block *ptr = malloc(sizeof(cache_block));
+  cache_blob *blob = NULL;
+  unsigned long long hash;
+  char *body = content, *packed = NULL;
+  int length = contentLength, compressedLength = 0;
 
-  cache_size += newSize;
+  // text is kept compressed if that saves at least an eighth of it
+  if ((*cache).compress && !gzip && contentLength >= COMPRESS_MIN &&
+      response_compressible(response))
+  {
+    packed = malloc(contentLength);
+    compressedLength = lz_compress(content, contentLength, packed,
+                                   contentLength - contentLength / 8);
+    if (compressedLength > 0)
+    {
+      body = packed;
+      length = compressedLength;
+    }
+  }
 
-  if (start == NULL)
+  strcpy((*ptr).uri, uri);
+  strcpy((*ptr).resp, response);
+  newSize = sizeof(cache_block) + length;
+  if ((*cache).dedup)
   {
-    start = ptr;
+    // share the body of a block with the same bytes, if there is one
+    hash = hash_body(body, length);
+    if ((blob = find_blob(cache, hash, body, length)) == NULL)
+      blob = add_blob(cache, hash, body, length);
+    else
+      newSize = sizeof(cache_block);
+    (*blob).cached++;
+    __atomic_fetch_add(&(*blob).refs, 1, __ATOMIC_RELAXED);
+    (*ptr).content = (*blob).data;
   }
   else
   {
-    (*backPtr).next = ptr;
+    (*ptr).content = malloc(sizeof(char) * length);
+    memcpy((*ptr).content, body, length);
   }
+  free(packed);
+  (*ptr).blob = blob;
+  (*ptr).contentLength = contentLength;
+  (*ptr).compressedLength = compressedLength;
+  (*ptr).offset = offset;
+  (*ptr).totalLength = totalLength;
+  (*ptr).gzip = gzip;
+  (*ptr).vary = vary;
+  (*ptr).frequency = frequency;
+  (*ptr).priority = gdsf_priority(cache, ptr);
+  (*ptr).expires = expires;
+  (*ptr).refs = 1;
 
-  cache_replacement_policy();
+  append_block(cache, ptr);
+  (*cache).cache_size += newSize;
+
+  cache_replacement_policy(cache);
 
   return 1;
 }
+
+int add_cache_block(cache_t *cache, char *uri, char *content, char *response,
+                    int contentLength, int offset, int totalLength)
+{
+  /*
+ * add_cache_block: 
+ *        add the uri information into the proxy cache 
+ * params:
+ *    - cache: the cache
+ *    - uri: uri string.
+ *    - content: the content of uri
+ *    - response: response header 
+ *    - contentLength: byte length of the HTTP body
+ *    - offset: position of the body in the whole object
+ *    - totalLength: length of the whole object. A block with
+ *        contentLength < totalLength is a partial object (206 response)
+ *        and only answers Range requests.
+ *    Content-Encoding and Vary of the response decide whether the block
+ *    is a gzip variant and which clients it can be served to.
+ * 
+ */
+  return insert_block(cache, uri, content, response, contentLength, offset, totalLength, 0, 1);
+}
+
+int add_error_block(cache_t *cache, char *uri, char *content, char *response,
+                    int contentLength, int ttl)
+{
+  /*
+ * add_error_block: 
+ *        negative caching: keep an error response of the origin (404,
+ *        5xx, ...) for a short time, so repeated requests for a bad uri
+ *        are answered from memory instead of going to the origin again
+ * params:
+ *    - cache: the cache
+ *    - uri: uri string.
+ *    - content: the body of the error response
+ *    - response: response header
+ *    - contentLength: byte length of the body
+ *    - ttl: seconds the response is served from the cache
+ * 
+ */
+  return insert_block(cache, uri, content, response, contentLength, 0, contentLength,
+                      time(NULL) + ttl, 1);
+}
+
+long cache_snapshot(cache_t *cache, char *buf, long size)
+{
+  /*
+ * cache_snapshot: 
+ *        copy the blocks of the cache into buf, oldest first, so that
+ *        another process can restore them with cache_restore (hot restart).
+ *        Expired error blocks are left out; compressed bodies are expanded.
+ * params:
+ *    - cache: the cache
+ *    - buf: output buffer, NULL to only compute the length
+ *    - size: size of buf
+ * return: length of the snapshot, -1 if buf is too small
+ */
+  snapshot_record rec;
+  cache_block *ptr;
+  long n = 0, length;
+  char *p;
+
+  for (ptr = (*cache).start; ptr != NULL; ptr = (*ptr).next)
+  {
+    if ((*ptr).expires != 0 && time(NULL) >= (*ptr).expires)
+      continue;
+    rec.uriLength = strlen((*ptr).uri);
+    rec.respLength = strlen((*ptr).resp);
+    rec.contentLength = (*ptr).contentLength;
+    rec.offset = (*ptr).offset;
+    rec.totalLength = (*ptr).totalLength;
+    rec.frequency = (*ptr).frequency;
+    rec.expires = (*ptr).expires;
+    length = RECORD_SIZE(rec.uriLength, rec.respLength, rec.contentLength);
+    if (buf != NULL)
+    {
+      if (n + length > size)
+        return -1;
+      p = buf + n;
+      memcpy(p, &rec, sizeof(rec));
+      p += sizeof(rec);
+      memcpy(p, (*ptr).uri, rec.uriLength + 1);
+      p += rec.uriLength + 1;
+      memcpy(p, (*ptr).resp, rec.respLength + 1);
+      p += rec.respLength + 1;
+      if ((*ptr).compressedLength)
+        lz_decompress((*ptr).content, (*ptr).compressedLength, p, rec.contentLength);
+      else
+        memcpy(p, (*ptr).content, rec.contentLength);
+    }
+    n += length;
+  }
+  return n;
+}
+
+int cache_restore(cache_t *cache, char *buf, long size, int shard, int n)
+{
+  /*
+ * cache_restore: 
+ *        add the blocks of a snapshot made by cache_snapshot to the cache,
+ *        in the order they were taken; their hit counts carry over
+ * params:
+ *    - cache: the cache
+ *    - buf, size: the snapshot
+ *    - shard, n: only the blocks whose uri belongs to shard of n
+ *        (cache_shard) are restored
+ * return: number of blocks restored, -1 if the snapshot is malformed;
+ *         a record with an empty uri (zero padding) ends the snapshot
+ */
+  snapshot_record rec;
+  char *uri, *resp;
+  long pos = 0;
+  int restored = 0;
+
+  while (pos < size)
+  {
+    if (pos + (long)sizeof(rec) > size)
+      return -1;
+    memcpy(&rec, buf + pos, sizeof(rec));
+    if (rec.uriLength == 0)
+      break;
+    if (rec.uriLength < 0 || rec.uriLength >= URI_SIZE || rec.respLength < 0 ||
+        rec.respLength >= RESP_SIZE || rec.contentLength < 0 ||
+        pos + RECORD_SIZE(rec.uriLength, rec.respLength, rec.contentLength) > size)
+      return -1;
+    uri = buf + pos + sizeof(rec);
+    resp = uri + rec.uriLength + 1;
+    if (uri[rec.uriLength] != '\0' || resp[rec.respLength] != '\0')
+      return -1;
+
+    if (cache_shard(uri, n) == shard &&
+        insert_block(cache, uri, resp + rec.respLength + 1, resp, rec.contentLength,
+                     rec.offset, rec.totalLength, rec.expires, rec.frequency))
+      restored++;
+    pos += RECORD_SIZE(rec.uriLength, rec.respLength, rec.contentLength);
+  }
+  return restored;
+}
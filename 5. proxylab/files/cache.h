@@ -3,15 +3,40 @@
  * Author: Jiwong Ko
  * Email: jiwong@csap.snu.ac.kr
  */
+#ifndef __CACHE_H__
+#define __CACHE_H__
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #define MAX_OBJECT_SIZE 200000 // 200kB is maximum for one requests
 #define MAX_CACHE_SIZE 1000000 // MAX CACHE SIZE should be 1MB
 #define URI_SIZE 1024
 #define RESP_SIZE 1024 
+#define COMPRESS_MIN 512       // smaller text bodies are not worth compressing
+
+/// cache replacement policies
+#define POLICY_FIFO 0   // evict the oldest block
+#define POLICY_LRU 1    // evict the least recently used block
+#define POLICY_LFU 2    // evict the least frequently used block
+#define POLICY_GDSF 3   // greedy-dual-size-frequency: evict the block with
+                        // the lowest inflation + frequency / size
+
+/// bodies are content addressed: blocks with byte-identical bodies (query
+/// string variants, mirrored paths) share one blob, found by the hash of
+/// the body and confirmed by comparing the bytes
+#define BLOB_BUCKETS 1024
+
+typedef struct cache_blob{
+	unsigned long long hash;  // FNV-1a of the body
+	int length;
+	int cached;               // blocks in the cache sharing it (cache lock)
+	int refs;                 // blocks alive sharing it, evicted ones included
+	struct cache_blob* next;  // hash chain
+	char data[];
+} cache_blob;
 
 typedef struct cache_block{
 	/* 
@@ -24,13 +49,98 @@ typedef struct cache_block{
 	 */
 	char uri[URI_SIZE];
 	char resp[RESP_SIZE];
-	char* content;
+	char* content;    // data of blob, or a private copy if blob is NULL
+	cache_blob* blob;
 	int contentLength;
+	int compressedLength; // content is lz-compressed to this length (lz.c),
+	                      // 0 if it is stored as is
+	int offset;       // position of content in the object (partial blocks)
+	int totalLength;  // length of the whole object
+	char gzip;        // the body is gzip-encoded
+	char vary;        // the origin varies the body on Accept-Encoding
+	int frequency;    // number of hits + 1 (LFU, GDSF)
+	double priority;  // GDSF key
+	time_t expires;   // error responses (negative caching) expire, 0: never
+	int refs;         // 1 for the cache while the block is in it, +1 per
+	                  // reader holding it (cache_hold)
+	struct cache_block* prev;
 	struct cache_block* next;
 } cache_block;
 
+/// online miss ratio curve estimation (SHARDS): a spatially hashed sample
+/// of the looked up URIs is kept in an LRU stack and the byte reuse
+/// distance of every sampled lookup, scaled by the sampling rate, is
+/// counted in a histogram. The sampled objects are found through a hash
+/// table, and the distance is a range sum of a Fenwick tree holding the
+/// size of every object at the time of its last reference, so a lookup
+/// costs O(log MRC_MAX_OBJECTS) rather than a walk of the stack.
+#define MRC_SAMPLE_RATE 0.0625  // fraction of URIs sampled
+#define MRC_BUCKET 131072       // histogram resolution in bytes
+#define MRC_BUCKETS 128         // curve up to 16MB of cache
+#define MRC_MAX_OBJECTS 4096    // sampled objects tracked in the stack
+#define MRC_HASH 4096           // hash buckets of the sampled objects, power of two
+#define MRC_TIMES (2 * MRC_MAX_OBJECTS) // reference times before they are renumbered
+
+typedef struct mrc_object{
+	unsigned long long key;   // hash of the URI
+	int size;                 // object size, 0 until known, -1 if uncacheable
+	int time;                 // time of its last reference, index in the tree
+	struct mrc_object* hnext; // hash chain
+	struct mrc_object* prev;
+	struct mrc_object* next;
+} mrc_object;
+
+typedef struct mrc_t{
+	mrc_object* top;          // most recently referenced sampled object
+	mrc_object* bottom;
+	int objects;
+	mrc_object** index;       // MRC_HASH chains, allocated on the first sample
+	long* tree;               // Fenwick tree of sizes by reference time
+	int now;                  // last reference time handed out
+	long histogram[MRC_BUCKETS];
+	long beyond;              // reuse distance past the last bucket
+	long cold;                // first references
+	long samples;
+} mrc_t;
+
+typedef struct cache_t{
+	cache_block* start;     // blocks in insertion (FIFO) or recency (LRU) order
+	cache_block* end;
+	int cache_size;
+	int max_cache_size;
+	int max_object_size;
+	int policy;
+	double inflation;       // GDSF aging value, priority of the last victim
+	char dedup;             // share identical bodies (default), see cache_blob
+	char compress;          // lz-compress text bodies (off by default)
+	cache_blob* blobs[BLOB_BUCKETS];
+	long hits;              // lookups of complete objects
+	long misses;
+	mrc_t mrc;
+} cache_t;
+
 /// cache function prototypes 
-cache_block* find_cache_block(char* uri);
-void cache_replacement_policy();
-int add_cache_block(char* uri, char* content, char* response, int contentLength);
+void cache_init(cache_t* cache, int policy, int maxCacheSize, int maxObjectSize);
+void cache_free(cache_t* cache);
+int cache_policy(char* name);
+char* cache_policy_name(int policy);
+int cache_shard(char* uri, int n);
+cache_block* find_cache_block(cache_t* cache, char* uri, int acceptGzip);
+cache_block* find_cache_any(cache_t* cache, char* uri, int acceptGzip);
+cache_block* find_cache_range(cache_t* cache, char* uri, int gzip, int first, int last);
+void remove_cache_block(cache_t* cache, cache_block* block);
+void cache_hold(cache_block* block);
+void cache_release(cache_block* block);
+cache_block* cache_expand(cache_block* block);
+void cache_replacement_policy(cache_t* cache);
+void cache_object_size(cache_t* cache, char* uri, int size);
+double cache_estimate_miss_ratio(cache_t* cache, long size);
+int cache_stats(cache_t* cache, char* buf, int size);
+int add_cache_block(cache_t* cache, char* uri, char* content, char* response,
+                    int contentLength, int offset, int totalLength);
+int add_error_block(cache_t* cache, char* uri, char* content, char* response,
+                    int contentLength, int ttl);
+long cache_snapshot(cache_t* cache, char* buf, long size);
+int cache_restore(cache_t* cache, char* buf, long size, int shard, int n);
 
+#endif /* __CACHE_H__ */
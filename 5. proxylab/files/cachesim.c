@@ -0,0 +1,191 @@
+/*
+ * cachesim.c - offline cache simulator
+ *
+ *     Replays the requests recorded in a proxy.log against the proxy cache
+ *     (cache.c) with every replacement policy and a sweep of cache and
+ *     object size limits, and prints the miss ratio and byte miss ratio of
+ *     each configuration. Use it to size the cache from real traffic.
+ *
+ *     usage: cachesim [-p policies] [-c cache sizes] [-o object sizes] <log>
+ *         lists are comma separated, sizes in bytes with an optional
+ *         k or m suffix, e.g. cachesim -p lru,gdsf -c 512k,1m,2m proxy.log
+ */
+#include "csapp.h"
+#include "cache.h"
+
+#define MAX_CONFIGS 64
+
+/// one replayed request
+typedef struct {
+  char *uri;
+  int length;
+} request;
+
+int read_log(char *filename, request **reqs);
+int parse_list(char *list, int *values, int sizes);
+int parse_size(char *s);
+void simulate(request *reqs, int n, int policy, int cacheSize, int objectSize);
+void usage(char *prog);
+
+/// stand-in for the bodies and the response header stored in the cache
+char *body;
+char header[] = "HTTP/1.0 200 OK\r\n\r\n";
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  int c, n, i, j, k, maxObject = 0;
+  int policies[MAX_CONFIGS], npolicies = 4;
+  int cacheSizes[MAX_CONFIGS], ncacheSizes;
+  int objectSizes[MAX_CONFIGS], nobjectSizes;
+  request *reqs;
+
+  for (i = 0; i < npolicies; i++)
+    policies[i] = i;
+  ncacheSizes = parse_list("256k,512k,1m,2m,4m,8m,16m", cacheSizes, 1);
+  nobjectSizes = parse_list("100k,200k,1m", objectSizes, 1);
+
+  while ((c = getopt(argc, argv, "p:c:o:")) != EOF) {
+    switch (c) {
+      case 'p':             /* replacement policies */
+        npolicies = parse_list(optarg, policies, 0);
+        break;
+      case 'c':             /* cache sizes (MAX_CACHE_SIZE) */
+        ncacheSizes = parse_list(optarg, cacheSizes, 1);
+        break;
+      case 'o':             /* object sizes (MAX_OBJECT_SIZE) */
+        nobjectSizes = parse_list(optarg, objectSizes, 1);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    usage(argv[0]);
+
+  n = read_log(argv[optind], &reqs);
+  for (i = 0; i < n; i++)
+    if (reqs[i].length > maxObject)
+      maxObject = reqs[i].length;
+  body = Calloc(maxObject + 1, 1);
+
+  printf("%d requests\n", n);
+  printf("%-6s %12s %12s %12s %12s\n", "policy", "object size", "cache size",
+         "miss ratio", "byte miss");
+  for (i = 0; i < npolicies; i++)
+    for (j = 0; j < nobjectSizes; j++)
+      for (k = 0; k < ncacheSizes; k++)
+        simulate(reqs, n, policies[i], cacheSizes[k], objectSizes[j]);
+  exit(0);
+}
+
+//-----------------------------------------------------------------------------
+void simulate(request *reqs, int n, int policy, int cacheSize, int objectSize)
+{
+/*
+ * simulate:
+ *        replays all requests against an empty cache and prints one line
+ *        of the miss ratio curves. Every request is treated as a full GET;
+ *        a hit whose cached length differs from the logged one (the object
+ *        changed) counts as a miss, and the old block is removed before
+ *        the new one is added.
+ */
+  cache_t cache;
+  cache_block *block;
+  long misses = 0, bytes = 0, missBytes = 0;
+  int i;
+
+  cache_init(&cache, policy, cacheSize, objectSize);
+  cache.dedup = 0;          /// every body is the same run of zeros
+  for (i = 0; i < n; i++) {
+    bytes += reqs[i].length;
+    block = find_cache_block(&cache, reqs[i].uri, 0);
+    if (block != NULL && (*block).contentLength == reqs[i].length)
+      continue;
+    if (block != NULL)
+      remove_cache_block(&cache, block);
+    misses++;
+    missBytes += reqs[i].length;
+    add_cache_block(&cache, reqs[i].uri, body, header, reqs[i].length, 0, reqs[i].length);
+  }
+  cache_free(&cache);
+
+  printf("%-6s %12d %12d %12.4f %12.4f\n", cache_policy_name(policy), objectSize, cacheSize,
+         n ? (double)misses / n : 0, bytes ? (double)missBytes / bytes : 0);
+}
+
+//-----------------------------------------------------------------------------
+int read_log(char *filename, request **reqs)
+{
+/*
+ * read_log:
+ *        reads the requests of a proxy.log written by proxy_cache_log():
+ *        "[cached|uncached] <date> KST: <uri> <content length> [partial]"
+ *        Range requests (marked partial) are skipped: their length is not
+ *        the size of the object.
+ * return: number of requests
+ */
+  FILE *fp = Fopen(filename, "r");
+  char line[MAXLINE], uri[MAXLINE], mark[MAXLINE], *p;
+  int n = 0, capacity = 1024, length;
+
+  *reqs = Malloc(capacity * sizeof(request));
+  while (fgets(line, MAXLINE, fp) != NULL) {
+    if ((p = strstr(line, "KST: ")) == NULL || sscanf(p + 5, "%s %d", uri, &length) != 2)
+      continue;
+    if (sscanf(p + 5, "%*s %*d %s", mark) == 1 && !strcmp(mark, "partial"))
+      continue;
+    if (n == capacity) {
+      capacity *= 2;
+      *reqs = Realloc(*reqs, capacity * sizeof(request));
+    }
+    (*reqs)[n].uri = strdup(uri);
+    (*reqs)[n].length = length;
+    n++;
+  }
+  Fclose(fp);
+  return n;
+}
+
+//-----------------------------------------------------------------------------
+int parse_list(char *list, int *values, int sizes)
+{
+/*
+ * parse_list:
+ *        parses a comma separated list of sizes or policy names
+ * return: number of values
+ */
+  char buf[MAXLINE], *item, *save;
+  int n = 0;
+
+  strncpy(buf, list, MAXLINE - 1);
+  buf[MAXLINE - 1] = '\0';
+  for (item = strtok_r(buf, ",", &save); item != NULL && n < MAX_CONFIGS;
+       item = strtok_r(NULL, ",", &save)) {
+    values[n] = sizes ? parse_size(item) : cache_policy(item);
+    if (sizes ? values[n] <= 0 : values[n] < 0) {
+      fprintf(stderr, "bad %s: %s\n", sizes ? "size" : "policy", item);
+      exit(1);
+    }
+    n++;
+  }
+  return n;
+}
+
+int parse_size(char *s)
+{
+  char *end;
+  double v = strtod(s, &end);
+
+  if (*end == 'k' || *end == 'K')
+    v *= 1000;
+  else if (*end == 'm' || *end == 'M')
+    v *= 1000000;
+  return (int)v;
+}
+
+void usage(char *prog)
+{
+  fprintf(stderr, "usage: %s [-p policies] [-c cache sizes] [-o object sizes] <log>\n", prog);
+  exit(1);
+}
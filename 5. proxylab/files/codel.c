@@ -0,0 +1,89 @@
+#include "codel.h"
+#include <string.h>
+#include <time.h>
+
+#define TARGET (CODEL_TARGET_MS * 1000L)
+#define INTERVAL (CODEL_INTERVAL_MS * 1000L)
+
+// monotonic time in microseconds
+long codel_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+void codel_init(codel_t *codel)
+{
+  memset(codel, 0, sizeof(codel_t));
+}
+
+// integer square root (no libm)
+static long isqrt(long n)
+{
+  long x = n, y = (n + 1) / 2;
+
+  while (y < x)
+  {
+    x = y;
+    y = (x + n / x) / 2;
+  }
+  return x;
+}
+
+// the next shed: sooner the more requests were shed in a row
+static long control_law(long t, int count)
+{
+  return t + INTERVAL / isqrt(count);
+}
+
+int codel_shed(codel_t *codel, long sojourn, long now)
+{
+/*
+ * codel_shed:
+ *        decides the fate of a request that is about to be served
+ * params:
+ *    - codel: the controller of the queue the request waited in
+ *    - sojourn: how long it waited, in microseconds
+ *    - now: codel_now()
+ * return: 1 if the request is to be shed, 0 if it is admitted
+ */
+  int standing = 0;
+
+  if (sojourn < TARGET)
+    (*codel).first_above = 0;
+  else if ((*codel).first_above == 0)
+    (*codel).first_above = now + INTERVAL;
+  else if (now >= (*codel).first_above)
+    standing = 1;
+
+  if ((*codel).dropping)
+  {
+    if (!standing)
+    {
+      (*codel).dropping = 0;
+    }
+    else if (now >= (*codel).drop_next)
+    {
+      (*codel).count++;
+      (*codel).drop_next = control_law((*codel).drop_next, (*codel).count);
+      (*codel).shed++;
+      return 1;
+    }
+  }
+  else if (standing)
+  {
+    /// a queue that just left the dropping state starts near its old rate
+    (*codel).dropping = 1;
+    if ((*codel).count > 2 && now - (*codel).drop_next < 16 * INTERVAL)
+      (*codel).count -= 2;
+    else
+      (*codel).count = 1;
+    (*codel).drop_next = control_law(now, (*codel).count);
+    (*codel).shed++;
+    return 1;
+  }
+  (*codel).admitted++;
+  return 0;
+}
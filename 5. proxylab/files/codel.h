@@ -0,0 +1,30 @@
+/*
+ * codel.h - CoDel-style admission control for the proxy
+ *
+ * The controller watches how long requests waited before they were
+ * served (their sojourn time). A short burst is absorbed, but once the
+ * sojourn stayed above CODEL_TARGET_MS for a whole CODEL_INTERVAL_MS
+ * the queue is a standing one, and requests are shed at a rate that
+ * grows with the square root of the number shed until the delay falls
+ * back under the target.
+ */
+#ifndef __CODEL_H__
+#define __CODEL_H__
+
+#define CODEL_TARGET_MS 20
+#define CODEL_INTERVAL_MS 200
+
+typedef struct {
+	long first_above;         // when the sojourn may count as standing, 0: below target
+	long drop_next;           // next shed while dropping
+	int count;                // requests shed in this dropping state
+	char dropping;
+	long shed;
+	long admitted;
+} codel_t;
+
+long codel_now(void);
+void codel_init(codel_t *codel);
+int codel_shed(codel_t *codel, long sojourn, long now);
+
+#endif /* __CODEL_H__ */
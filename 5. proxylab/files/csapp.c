@@ -1,5 +1,7 @@
 /* $begin csapp.c */
+#define _GNU_SOURCE /* splice() */
 #include "csapp.h"
+#include <poll.h>
 
 /************************** 
  * Error-handling functions
@@ -572,6 +574,136 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - robustly write a vector of buffers (unbuffered)
+ *    Gathers all the buffers into as few writev() calls as the kernel
+ *    allows. The iovec array is modified as bytes are written.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+
+    while (iovcnt > 0) {
+	if (iov->iov_len == 0) {   /* skip drained buffers */
+	    iov++;
+	    iovcnt--;
+	    continue;
+	}
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errorno set by writev() */
+	}
+	while (nwritten > 0 && nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov->iov_len = 0;
+	    iov++;
+	    iovcnt--;
+	}
+	if (nwritten > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return n;
+}
+
+/*
+ * rio_sendfile - robustly copy n bytes of a file to a descriptor
+ *    inside the kernel. *offset is advanced past the bytes sent, so a
+ *    caller can tell how far a failed transfer got.
+ */
+ssize_t rio_sendfile(int out_fd, int in_fd, off_t *offset, size_t n)
+{
+    size_t nleft = n;
+    ssize_t nsent;
+
+    while (nleft > 0) {
+	if ((nsent = sendfile(out_fd, in_fd, offset, nleft)) <= 0) {
+	    if (nsent < 0 && errno == EINTR) /* interrupted by sig handler */
+		nsent = 0;                   /* and call sendfile() again */
+	    else if (nsent == 0)
+		break;                       /* file shrank under us */
+	    else
+		return -1;                   /* errno set by sendfile() */
+	}
+	nleft -= nsent;
+    }
+    return (n - nleft);
+}
+
+/*
+ * rio_splice - robustly move n bytes from one descriptor to another
+ *    (e.g. socket to socket) through the pipe pipefd without copying
+ *    them to user space. Returns the number of bytes moved, less than n
+ *    on EOF of in_fd. On error -1 is returned and the pipe may still hold
+ *    data, so the caller must not reuse it. Either way the number of bytes
+ *    written to out_fd is stored in *moved (if moved is not NULL).
+ */
+ssize_t rio_splice(int out_fd, int in_fd, int pipefd[2], size_t n, size_t *moved)
+{
+    size_t nleft = n, nout_total = 0;
+    ssize_t nin, nout;
+
+    if (moved != NULL)
+	*moved = 0;
+    while (nleft > 0) {
+	if ((nin = splice(in_fd, NULL, pipefd[1], NULL, nleft,
+			  SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (nin == 0)
+	    break;                           /* EOF */
+	nleft -= nin;
+	while (nin > 0) {                    /* drain the pipe */
+	    if ((nout = splice(pipefd[0], NULL, out_fd, NULL, nin,
+			       SPLICE_F_MOVE | (nleft ? SPLICE_F_MORE : 0))) <= 0) {
+		if (nout < 0 && errno == EINTR)
+		    continue;
+		return -1;
+	    }
+	    nin -= nout;
+	    nout_total += nout;
+	    if (moved != NULL)
+		*moved = nout_total;
+	}
+    }
+    return (n - nleft);
+}
+
+/*
+ * rio_wait - wait for rp's descriptor to become readable before its
+ *    deadline. Returns 0, or -1 with errno ETIMEDOUT once it passed.
+ */
+static int rio_wait(rio_t *rp)
+{
+    struct pollfd pfd = {rp->rio_fd, POLLIN, 0};
+    struct timespec now;
+    long left;
+    int rc;
+
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = rp->rio_deadline - (now.tv_sec * 1000L + now.tv_nsec / 1000000);
+	if (left <= 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+    } while ((rc = poll(&pfd, 1, left)) < 0 && errno == EINTR);
+    if (rc == 0) {
+	errno = ETIMEDOUT;
+	return -1;
+    }
+    return rc < 0 ? -1 : 0;
+}
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -587,6 +719,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
+	if (rp->rio_deadline && rio_wait(rp) < 0)
+	    return -1;
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
@@ -619,9 +753,23 @@ void rio_readinitb(rio_t *rp, int fd)
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_deadline = 0;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_setdeadline - make the buffered reads of rp fail with ETIMEDOUT
+ *    once ms milliseconds from now have passed, however the data trickles
+ *    in (0: no deadline)
+ */
+void rio_setdeadline(rio_t *rp, int ms)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rp->rio_deadline = ms ? now.tv_sec * 1000L + now.tv_nsec / 1000000 + ms : 0;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -693,6 +841,18 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev error");
+}
+
+void Rio_sendfile(int out_fd, int in_fd, off_t *offset, size_t n)
+{
+    if (rio_sendfile(out_fd, in_fd, offset, n) < 0)
+	unix_error("Rio_sendfile error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -736,8 +896,10 @@ int open_clientfd(char *hostname, int port)
 	return -1; /* check errno for cause of error */
 
     /* Fill in the server's IP address and port */
-    if ((hp = gethostbyname(hostname)) == NULL)
+    if ((hp = gethostbyname(hostname)) == NULL) {
+	close(clientfd);
 	return -2; /* check h_errno for cause of error */
+    }
     bzero((char *) &serveraddr, sizeof(serveraddr));
     serveraddr.sin_family = AF_INET;
     bcopy((char *)hp->h_addr_list[0], 
@@ -745,18 +907,67 @@ int open_clientfd(char *hostname, int port)
     serveraddr.sin_port = htons(port);
 
     /* Establish a connection with the server */
-    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
+    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0) {
+	close(clientfd);
 	return -1;
+    }
     return clientfd;
 }
 /* $end open_clientfd */
 
+/*
+ * open_clientfd_r - thread-safe open_clientfd: resolves hostname with
+ *     getaddrinfo() instead of gethostbyname(). A connect that takes
+ *     longer than CONNECT_TIMEOUT seconds fails.
+ *   Returns -1 and sets errno on Unix error. 
+ *   Returns -2 on DNS error.
+ */
+int open_clientfd_r(char *hostname, int port) 
+{
+    int clientfd = -1;
+    char service[16];
+    struct addrinfo hints, *list, *p;
+    struct timeval timeout = {CONNECT_TIMEOUT, 0}, none = {0, 0};
+
+    sprintf(service, "%d", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(hostname, service, &hints, &list) != 0)
+	return -2;
+    for (p = list; p != NULL; p = p->ai_next) {
+	if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+	    continue;
+	/* connect() honors the send timeout; it is cleared again after */
+	setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
+	    setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+	    break;
+	}
+	close(clientfd);
+	clientfd = -1;
+    }
+    freeaddrinfo(list);
+    return clientfd;
+}
+
 /*  
  * open_listenfd - open and return a listening socket on port
  *     Returns -1 and sets errno on Unix error.
  */
 /* $begin open_listenfd */
 int open_listenfd(int port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_listenfd_opt - open_listenfd with SO_REUSEPORT optionally set,
+ *     so several processes can each own a listening socket on the same
+ *     port and the kernel load-balances incoming connections among them.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd_opt(int port, int reuseport) 
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -770,6 +981,11 @@ int open_listenfd(int port)
 		   (const void *)&optval , sizeof(int)) < 0)
 	return -1;
 
+    /* Lets every worker bind its own socket to the same port */
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, 
+				(const void *)&optval , sizeof(int)) < 0)
+	return -1;
+
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     bzero((char *) &serveraddr, sizeof(serveraddr));
@@ -786,6 +1002,68 @@ int open_listenfd(int port)
 }
 /* $end open_listenfd */
 
+/*
+ * send_fds - pass the n descriptors fds to the process at the other end
+ *     of the Unix domain socket sock (SCM_RIGHTS), with a one byte
+ *     message. Returns -1 and sets errno on Unix error.
+ */
+int send_fds(int sock, int *fds, int n)
+{
+    char byte = 0, control[CMSG_SPACE(16 * sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    if (n > 16) {
+	errno = EINVAL;
+	return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/*
+ * recv_fds - receive n descriptors sent with send_fds into fds.
+ *     Returns -1 on Unix error or if the message did not carry exactly
+ *     n descriptors.
+ */
+int recv_fds(int sock, int *fds, int n)
+{
+    char byte, control[CMSG_SPACE(16 * sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    if (n > 16) {
+	errno = EINVAL;
+	return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+	return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(n * sizeof(int))) {
+	errno = EPROTO;
+	return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+    return 0;
+}
+
 /******************************************
  * Wrappers for the client/server helper routines 
  ******************************************/
@@ -810,6 +1088,15 @@ int Open_listenfd(int port)
 	unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_opt(int port, int reuseport) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_opt(port, reuseport)) < 0)
+	unix_error("Open_listenfd_opt error");
+    return rc;
+}
 /* $end csapp.c */
 
 
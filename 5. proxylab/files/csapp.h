@@ -23,6 +23,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
 /* $begin createmasks */
 #define DEF_MODE   S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH
@@ -41,6 +43,7 @@ typedef struct {
     int rio_fd;                /* descriptor for this internal buf */
     int rio_cnt;               /* unread bytes in internal buf */
     char *rio_bufptr;          /* next unread byte in internal buf */
+    long rio_deadline;         /* ms (CLOCK_MONOTONIC) reads must end by, 0: none */
     char rio_buf[RIO_BUFSIZE]; /* internal buffer */
 } rio_t;
 /* $end rio_t */
@@ -52,6 +55,7 @@ extern char **environ; /* defined by libc */
 /* Misc constants */
 #define	MAXLINE	 8192  /* max text line length */
 #define MAXBUF   8192  /* max I/O buffer size */
+#define CONNECT_TIMEOUT 5 /* seconds open_clientfd_r waits for a connect */
 #define LISTENQ  1024  /* second argument to listen() */
 
 /* Our own error-handling functions */
@@ -143,24 +147,35 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
+ssize_t rio_sendfile(int out_fd, int in_fd, off_t *offset, size_t n);
+ssize_t rio_splice(int out_fd, int in_fd, int pipefd[2], size_t n, size_t *moved);
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_setdeadline(rio_t *rp, int ms);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
+void Rio_sendfile(int out_fd, int in_fd, off_t *offset, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
+int open_clientfd_r(char *hostname, int portno);
 int open_listenfd(int portno);
+int open_listenfd_opt(int portno, int reuseport);
+int send_fds(int sock, int *fds, int n);
+int recv_fds(int sock, int *fds, int n);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_opt(int port, int reuseport);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
@@ -0,0 +1,177 @@
+#include "filecache.h"
+
+/// hash table of entries plus an LRU list used for eviction
+file_entry *buckets[FC_BUCKETS];
+file_entry *lru_head = NULL;
+file_entry *lru_tail = NULL;
+int mapped_size = 0;
+
+// FNV-1a hash of the filename and the variant
+static unsigned int hash_name(char *filename, int variant)
+{
+  unsigned int h = 2166136261u;
+  while (*filename)
+  {
+    h ^= (unsigned char)*filename++;
+    h *= 16777619u;
+  }
+  h ^= variant;
+  h *= 16777619u;
+  return h & (FC_BUCKETS - 1);
+}
+
+static void lru_unlink(file_entry *ptr)
+{
+  if ((*ptr).prev != NULL)
+    (*(*ptr).prev).next = (*ptr).next;
+  else
+    lru_head = (*ptr).next;
+  if ((*ptr).next != NULL)
+    (*(*ptr).next).prev = (*ptr).prev;
+  else
+    lru_tail = (*ptr).prev;
+}
+
+static void lru_push_front(file_entry *ptr)
+{
+  (*ptr).prev = NULL;
+  (*ptr).next = lru_head;
+  if (lru_head != NULL)
+    (*lru_head).prev = ptr;
+  lru_head = ptr;
+  if (lru_tail == NULL)
+    lru_tail = ptr;
+}
+
+// unlink the entry from the table and the LRU list, then release the mapping
+static void remove_file_entry(file_entry *ptr)
+{
+  file_entry **link = &buckets[hash_name((*ptr).filename, (*ptr).variant)];
+  while (*link != ptr)
+    link = &(**link).hnext;
+  *link = (*ptr).hnext;
+  lru_unlink(ptr);
+
+  mapped_size -= (*ptr).filesize;
+  if ((*ptr).content != NULL)
+    Munmap((*ptr).content, (*ptr).filesize);
+  if ((*ptr).fd >= 0)
+    Close((*ptr).fd);
+  free(ptr);
+}
+
+// is the other file of an entry still as it was (or still missing)
+static int other_unchanged(file_entry *ptr)
+{
+  struct stat sbuf;
+
+  if ((*ptr).other[0] == '\0')
+    return 1;
+  if (stat((*ptr).other, &sbuf) < 0)
+    return !(*ptr).otherExists;
+  return (*ptr).otherExists && sbuf.st_ino == (*ptr).otherIno &&
+         sbuf.st_mtime == (*ptr).otherMtime && sbuf.st_size == (*ptr).otherSize;
+}
+
+file_entry *find_file_entry(char *filename, int variant)
+{
+/*
+ * find_file_entry:
+ *        look up a cached file. An entry whose file (or other file) was
+ *        modified, replaced, created or removed since it was mapped is
+ *        dropped and NULL is returned. The identities are rechecked at
+ *        most every FC_REVALIDATE seconds.
+ * params:
+ *    - filename: local path to file (as generated by parse_uri)
+ *    - variant: which version of the file (e.g. identity or gzip)
+ */
+  file_entry *ptr = buckets[hash_name(filename, variant)];
+  while (ptr != NULL && (strcmp(filename, (*ptr).filename) || variant != (*ptr).variant))
+    ptr = (*ptr).hnext;
+  if (ptr == NULL)
+    return NULL;
+
+  time_t now = time(NULL);
+  if (now - (*ptr).checked >= FC_REVALIDATE)
+  {
+    struct stat sbuf;
+    if (stat((*ptr).path, &sbuf) < 0 || sbuf.st_mtime != (*ptr).mtime ||
+        sbuf.st_ino != (*ptr).ino || sbuf.st_dev != (*ptr).dev ||
+        sbuf.st_size != (*ptr).filesize || !other_unchanged(ptr))
+    {
+      remove_file_entry(ptr);
+      return NULL;
+    }
+    (*ptr).checked = now;
+  }
+
+  lru_unlink(ptr);
+  lru_push_front(ptr);
+  return ptr;
+}
+
+file_entry *add_file_entry(char *filename, int variant, char *path, struct stat *sbuf,
+                           char *header, char *content, int fd, char *other,
+                           struct stat *otherbuf)
+{
+/*
+ * add_file_entry:
+ *        add a mapped or opened file to the cache. The cache takes ownership
+ *        of the mapping and the descriptor and releases them on eviction.
+ *        Least recently used entries are evicted while the total size of the
+ *        cached files exceeds FC_MAX_SIZE.
+ * params:
+ *    - filename: local path to the requested file
+ *    - variant: which version of the file
+ *    - path: local path to the file served for this variant
+ *    - sbuf: stat of path at the time it was mapped
+ *    - header: complete response header for the file
+ *    - content: mapping of the whole file (NULL for an empty file or
+ *               when the file is served with sendfile)
+ *    - fd: descriptor of the file for sendfile, -1 if unused
+ *    - other: second file the variant depends on, NULL if none
+ *    - otherbuf: stat of other, NULL if it does not exist
+ * return: the new entry, or NULL if the file is not cacheable
+ */
+  if (sbuf->st_size > FC_MAX_OBJECT || strlen(filename) >= FC_NAME_SIZE ||
+      strlen(path) >= FC_NAME_SIZE || strlen(header) >= FC_HDR_SIZE ||
+      (other != NULL && strlen(other) >= FC_NAME_SIZE))
+  {
+    return NULL;
+  }
+
+  file_entry *ptr = malloc(sizeof(file_entry));
+  strcpy((*ptr).filename, filename);
+  (*ptr).variant = variant;
+  strcpy((*ptr).path, path);
+  strcpy((*ptr).header, header);
+  (*ptr).headerLength = strlen(header);
+  (*ptr).content = content;
+  (*ptr).fd = fd;
+  (*ptr).filesize = sbuf->st_size;
+  (*ptr).dev = sbuf->st_dev;
+  (*ptr).ino = sbuf->st_ino;
+  (*ptr).mtime = sbuf->st_mtime;
+  strcpy((*ptr).other, other != NULL ? other : "");
+  (*ptr).otherExists = otherbuf != NULL;
+  if (otherbuf != NULL)
+  {
+    (*ptr).otherIno = otherbuf->st_ino;
+    (*ptr).otherMtime = otherbuf->st_mtime;
+    (*ptr).otherSize = otherbuf->st_size;
+  }
+  (*ptr).checked = time(NULL);
+
+  unsigned int h = hash_name(filename, variant);
+  (*ptr).hnext = buckets[h];
+  buckets[h] = ptr;
+  lru_push_front(ptr);
+  mapped_size += (*ptr).filesize;
+
+  while (mapped_size > FC_MAX_SIZE && lru_tail != ptr)
+  {
+    remove_file_entry(lru_tail);
+  }
+
+  return ptr;
+}
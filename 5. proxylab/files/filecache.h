@@ -0,0 +1,54 @@
+/*
+ * filecache.h - open-file/content cache for the static web server (http.c)
+ *
+ * Keeps the content of recently served files mapped in memory (or, in
+ * sendfile mode, the file open) together with a prebuilt response header,
+ * so a repeated request costs one hash lookup and one write instead of
+ * stat/open/mmap/close/munmap. Entries are keyed by the requested file and
+ * a variant number, so differently encoded versions of one file can be
+ * cached side by side. The choice of a variant may depend on a second
+ * file (a gzip entry on both the file and its .gz sibling); a change of
+ * either drops the entry.
+ */
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include "csapp.h"
+
+#define FC_BUCKETS 256            // hash buckets, power of two
+#define FC_MAX_SIZE 64000000      // total bytes of cached file content
+#define FC_MAX_OBJECT 16000000    // bigger files are mapped per request
+#define FC_REVALIDATE 1           // seconds between mtime checks of an entry
+#define FC_NAME_SIZE 1024
+#define FC_HDR_SIZE 512
+
+typedef struct file_entry{
+	char filename[FC_NAME_SIZE];    // key: requested file and variant
+	int variant;
+	char path[FC_NAME_SIZE];        // file actually served (e.g. a .gz sibling)
+	char header[FC_HDR_SIZE];       // prebuilt "200 OK" response header
+	int headerLength;
+	char* content;                  // mapped file content (NULL if empty)
+	int fd;                         // open file for sendfile, -1 if unused
+	int filesize;
+	dev_t dev;                      // identity of the file when it was mapped
+	ino_t ino;
+	time_t mtime;
+	char other[FC_NAME_SIZE];       // file the variant was also chosen by, "" if none
+	char otherExists;               // identity of other when the entry was added
+	ino_t otherIno;
+	time_t otherMtime;
+	off_t otherSize;
+	time_t checked;                 // last time the identity was verified
+	struct file_entry* hnext;       // hash chain
+	struct file_entry* prev;        // LRU list, most recent at the head
+	struct file_entry* next;
+} file_entry;
+
+/// file cache function prototypes
+file_entry* find_file_entry(char* filename, int variant);
+file_entry* add_file_entry(char* filename, int variant, char* path, struct stat* sbuf,
+                           char* header, char* content, int fd, char* other,
+                           struct stat* otherbuf);
+
+#endif /* __FILECACHE_H__ */
@@ -2,46 +2,188 @@
  * http.c - A simple, iterative HTTP/1.0 Web server that uses the
  *     GET method to serve static content.
  */
+#define _GNU_SOURCE     /* for sched_setaffinity() */
+#include <sched.h>
 #include "csapp.h"
+#include "filecache.h"
+#include "httputil.h"
+#include "mimehash.h"
+#include "mimetab.h"
 
+/// request headers the server acts on
+typedef struct {
+  char range[MAXLINE];      /* value of the Range header, "" if absent */
+  int gzip;                 /* Accept-Encoding allows gzip */
+} request_hdrs;
+
+void serve(int listenfd);
+void run_workers(int port);
+pid_t start_worker(int port, int id);
+void stop_workers(int sig);
 void doit(int fd);
-void print_requesthdrs(rio_t *rp);
+int read_requesthdrs(rio_t *rp, request_hdrs *hdrs);
 void parse_uri(char *uri, char *filename);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, struct stat *sbuf, request_hdrs *hdrs, int gzip);
+void serve_cached(int fd, file_entry *entry, request_hdrs *hdrs);
+int send_body(int fd, int srcfd, int offset, int length);
+void build_header(char *header, char *filetype, int filesize, int gzip);
 void get_filetype(char *filename, char *filetype);
 void clienterror(int fd, char *cause, char *errnum,
                  char *shortmsg, char *longmsg);
 
+/// deliver file bodies with sendfile() instead of mmap() + write()
+int use_sendfile = 0;
+
+/// number of worker processes, each accepting on its own SO_REUSEPORT
+/// socket (0: serve from the main process), and whether worker i is
+/// pinned to CPU i
+int num_workers = 0;
+int pin_workers = 0;
+pid_t *workers;
+
 //-----------------------------------------------------------------------------
 int main(int argc, char **argv)
 {
 /*
  * main: 
  *  listens for connections on the given port number, handles HTTP requests 
- *  with the doit function then closes the connection 
+ *  with the doit function then closes the connection. With -w the work is
+ *  spread over several worker processes.
  */  
 
-  int listenfd, connfd, port, clientlen;
-  struct sockaddr_in clientaddr;
+  int port, c;
 
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((c = getopt(argc, argv, "sw:c")) != EOF) {
+    switch (c) {
+      case 's':             /* send file bodies with sendfile() */
+        use_sendfile = 1;
+        break;
+      case 'w':             /* fork this many worker processes */
+        num_workers = atoi(optarg);
+        break;
+      case 'c':             /* pin each worker to its own CPU */
+        pin_workers = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-s] [-w workers [-c]] <port>\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-s] [-w workers [-c]] <port>\n", argv[0]);
     exit(1);
   }
 
-  /// listen for connections on the given port
+  port = atoi(argv[optind]);
+  if (num_workers > 0)
+    run_workers(port);
+  serve(Open_listenfd(port));
+}
+
+//-----------------------------------------------------------------------------
+void serve(int listenfd)
+{
+/*
+ * serve: 
+ *  accepts connections on the listening socket, handles HTTP requests 
+ *  with the doit function then closes the connection 
+ */  
+  int connfd, clientlen;
+  struct sockaddr_in clientaddr;
+
   /// if a client connects, accept the connection, handle the request
   /// (call the doit function), then close the connection
-  port = atoi(argv[1]);
-  listenfd = Open_listenfd(port);
+  /// a client that stalls in its request header, or trickles it in a
+  /// byte at a time, is dropped after HEADER_TIMEOUT seconds in total
+  /// instead of holding the server
   while(1){
     clientlen = sizeof(clientaddr);
     connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+    set_read_timeout(connfd, HEADER_TIMEOUT);
     doit(connfd);
     Close(connfd);
   }
 }
 
+//-----------------------------------------------------------------------------
+void run_workers(int port)
+{
+/*
+ * run_workers: 
+ *  forks num_workers worker processes and supervises them. Every worker
+ *  opens its own SO_REUSEPORT listening socket, so the kernel spreads
+ *  incoming connections over the workers without a shared accept lock.
+ *  A worker killed by a signal is restarted; if one exits on its own
+ *  (e.g. it could not bind the port) all workers are stopped.
+ * params:
+ *    - port: port number to listen on
+ */  
+  int i, status;
+  pid_t pid;
+
+  workers = Malloc(num_workers * sizeof(pid_t));
+  Signal(SIGINT, stop_workers);
+  Signal(SIGTERM, stop_workers);
+  for (i = 0; i < num_workers; i++)
+    workers[i] = start_worker(port, i);
+
+  while (1) {
+    pid = Wait(&status);
+    for (i = 0; i < num_workers; i++) {
+      if (workers[i] != pid)
+        continue;
+      if (!WIFSIGNALED(status)) {
+        fprintf(stderr, "worker %d exited with status %d\n", (int)pid, WEXITSTATUS(status));
+        workers[i] = 0;
+        stop_workers(SIGTERM);
+      }
+      workers[i] = start_worker(port, i);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+pid_t start_worker(int port, int id)
+{
+/*
+ * start_worker: 
+ *  forks worker number id, optionally pins it to a CPU and lets it serve
+ *  requests from its own listening socket
+ * return: pid of the worker
+ */  
+  pid_t pid;
+  cpu_set_t cpus;
+
+  if ((pid = Fork()) == 0) {
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTERM, SIG_DFL);
+    if (pin_workers) {
+      CPU_ZERO(&cpus);
+      CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+      if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+        unix_error("sched_setaffinity error");
+    }
+    serve(Open_listenfd_opt(port, 1));
+  }
+  return pid;
+}
+
+//-----------------------------------------------------------------------------
+void stop_workers(int sig)
+{
+/*
+ * stop_workers: 
+ *  SIGINT/SIGTERM handler of the supervisor: terminates all workers
+ *  and exits
+ */  
+  int i;
+
+  for (i = 0; i < num_workers; i++)
+    if (workers[i] > 0)
+      kill(workers[i], SIGTERM);
+  _exit(0);
+}
+
 //-----------------------------------------------------------------------------
 void doit(int fd)
 {
@@ -56,18 +198,25 @@ void doit(int fd)
 
   struct stat sbuf;
   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  char filename[MAXLINE]; 
+  char filename[MAXLINE], filetype[MAXLINE];
+  file_entry *entry;
+  request_hdrs hdrs;
+  int gzip;
 
   /// read and store the first line of the HTTP request in the corresponding
   /// variables (format: method uri and version)
   rio_t rio;
   Rio_readinitb(&rio, fd);
-  Rio_readlineb(&rio, buf, MAXLINE);
+  rio_setdeadline(&rio, HEADER_TIMEOUT * 1000);
+  if (rio_readlineb(&rio, buf, MAXLINE) <= 0)
+    return;
   sscanf(buf, "%s %s %s", method, uri, version);
 
   /// be sure to call this only after you have read out all the information
   /// you need from the request
-  print_requesthdrs(&rio);
+  if (read_requesthdrs(&rio, &hdrs) < 0)
+    return;
+  rio_setdeadline(&rio, 0);
   
   /// Check if the method is GET, if not return a 501 error using clienterror()
   if (strcmp(method, "GET")) {
@@ -81,6 +230,17 @@ void doit(int fd)
   /// Check if the requested path is a directory if so return 403 error
   parse_uri(uri, filename);
 
+  /// clients that accept gzip may get a precompressed version of text
+  /// files, which is cached as a separate variant of the file
+  get_filetype(filename, filetype);
+  gzip = hdrs.gzip && compressible(filetype);
+
+  /// files served recently are answered straight from the file cache
+  if ( (entry = find_file_entry(filename, gzip)) != NULL ) {
+    serve_cached(fd, entry, &hdrs);
+    return;
+  }
+
   if ( stat(filename, &sbuf) < 0 ) {
     clienterror(fd, filename, "404", "Not found", "This requested page does not exist");
     return;
@@ -93,55 +253,201 @@ void doit(int fd)
 
   /// If the file exists serve it to the client
   /// (implement the serve_static function)
-  serve_static(fd, filename, sbuf.st_size);
+  serve_static(fd, filename, &sbuf, &hdrs, gzip);
 }
 
 //-----------------------------------------------------------------------------
-void serve_static(int fd, char *filename, int filesize)
+void serve_static(int fd, char *filename, struct stat *sbuf, request_hdrs *hdrs, int gzip)
 {
 /*
  * serve_static: 
  *        builds and sends static HTTP requests to the client specified 
- *        by the fd argument
+ *        by the fd argument. The file and its header are kept in the
+ *        file cache for the following requests.
  * params:
  *    - fd: file descriptor of connection socket.
  *    - filename: local path to file
- *    - filesize: size of requested file
+ *    - sbuf: stat of the requested file
+ *    - hdrs: headers of the request
+ *    - gzip: the client accepts a gzip body for this file
  * return: void
  */    
 
-  int srcfd;
-  char *srcp, filetype[MAXLINE], responseBuffer[MAXBUF];
+  int srcfd, filesize, encoded = 0;
+  char *srcp = NULL, filetype[MAXLINE], responseBuffer[MAXBUF];
+  char path[MAXLINE], gzpath[MAXLINE], *other = NULL;
+  struct stat gzbuf, filebuf = *sbuf, *otherbuf = NULL;
+  file_entry *entry, file;
 
   /// First check the file type using get_filetype, also add images
   /// (jpg, gif, png) to the list of servable files
   get_filetype(filename, filetype);
 
-  /// Send the HTTP response header to the client 
-  /// Build valid response header and send to client
-  /// (check the clienterror function for reference)
-  sprintf(responseBuffer, "HTTP/1.0 200 OK\r\n");
-  Rio_writen(fd, responseBuffer, strlen(responseBuffer));
-  
+  /// Send the precompressed "<file>.gz" sibling instead when the client
+  /// accepts gzip and the sibling is at least as new as the file. The
+  /// gzip entry depends on both files: on the file if the sibling is sent,
+  /// on the sibling (or its absence) if the file is
+  strcpy(path, filename);
+  if (gzip) {
+    sprintf(gzpath, "%s.gz", filename);
+    if (stat(gzpath, &gzbuf) == 0 && S_ISREG(gzbuf.st_mode) &&
+        gzbuf.st_mtime >= sbuf->st_mtime) {
+      strcpy(path, gzpath);
+      sbuf = &gzbuf;
+      encoded = 1;
+      other = filename;
+      otherbuf = &filebuf;
+    } else {
+      other = gzpath;
+      otherbuf = stat(gzpath, &gzbuf) == 0 ? &gzbuf : NULL;
+    }
+  }
+  filesize = sbuf->st_size;
+
+  /// Build valid response header
+  build_header(responseBuffer, filetype, filesize, encoded);
+
+  /// Open the file. In sendfile mode the body is copied to the socket
+  /// from the open descriptor inside the kernel, otherwise the file is
+  /// mapped.
+  srcfd = Open(path, O_RDONLY, 0);
+  if (!use_sendfile) {
+    if (filesize > 0)
+      srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+    Close(srcfd);
+    srcfd = -1;
+  }
+
+  /// Keep the file in the file cache if it fits, then send the header and
+  /// the file content to the client
+  if ( (entry = add_file_entry(filename, gzip, path, sbuf, responseBuffer, srcp, srcfd,
+                                other, otherbuf)) != NULL ) {
+    serve_cached(fd, entry, hdrs);
+    return;
+  }
+
+  /// Too big for the file cache: serve it through a temporary entry
+  strcpy(file.header, responseBuffer);
+  file.headerLength = strlen(responseBuffer);
+  file.content = srcp;
+  file.fd = srcfd;
+  file.filesize = filesize;
+  serve_cached(fd, &file, hdrs);
+  if (file.content != NULL)
+    Munmap(file.content, filesize);
+  if (file.fd >= 0)
+    Close(file.fd);
+}
+
+//-----------------------------------------------------------------------------
+void serve_cached(int fd, file_entry *entry, request_hdrs *hdrs)
+{
+/*
+ * serve_cached: 
+ *        sends the header and the content of a file cache entry to the
+ *        client, either with a single gathering write of the mapped
+ *        content or with sendfile() from the cached descriptor. A
+ *        satisfiable Range request gets only the requested bytes in a
+ *        206 Partial Content response.
+ * params:
+ *    - fd: file descriptor of connection socket.
+ *    - entry: file cache entry of the requested file
+ *    - hdrs: headers of the request
+ * return: void
+ */    
+  struct iovec iov[2];
+  char buf[MAXLINE], *header = (*entry).header;
+  int headerLength = (*entry).headerLength;
+  int first = 0, last = (*entry).filesize - 1;
+
+  switch (parse_range((*hdrs).range, (*entry).filesize, &first, &last)) {
+    case -1:
+      sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n");
+      sprintf(buf + strlen(buf), "Server: Localhost\r\n");
+      sprintf(buf + strlen(buf), "Content-Range: bytes */%d\r\n", (*entry).filesize);
+      sprintf(buf + strlen(buf), "Content-Length: 0\r\n\r\n");
+      Rio_writen(fd, buf, strlen(buf));
+      return;
+    case 1:
+      build_range_header(buf, (*entry).header, first, last, (*entry).filesize);
+      header = buf;
+      headerLength = strlen(buf);
+      break;
+  }
+
+  if ((*entry).fd >= 0) {
+    Rio_writen(fd, header, headerLength);
+    if (send_body(fd, (*entry).fd, first, last - first + 1))
+      return;
+
+    /// sendfile is not supported for this file: map it once and keep
+    /// serving the entry from memory
+    if ((*entry).filesize > 0)
+      (*entry).content = Mmap(0, (*entry).filesize, PROT_READ, MAP_PRIVATE, (*entry).fd, 0);
+    Close((*entry).fd);
+    (*entry).fd = -1;
+    Rio_writen(fd, (*entry).content + first, last - first + 1);
+    return;
+  }
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = headerLength;
+  iov[1].iov_base = (*entry).content + first;
+  iov[1].iov_len = last - first + 1;
+  Rio_writev(fd, iov, 2);
+}
+
+//-----------------------------------------------------------------------------
+int send_body(int fd, int srcfd, int offset, int length)
+{
+/*
+ * send_body: 
+ *        copies length bytes of a file starting at offset to the
+ *        connection socket with sendfile()
+ * params:
+ *    - fd: file descriptor of connection socket.
+ *    - srcfd: descriptor of the file to send
+ *    - offset: first byte to send
+ *    - length: number of bytes to send
+ * return: 1 if the body was sent, 0 if sendfile() cannot be used for
+ *         this file and nothing was sent (the caller falls back to mmap)
+ */    
+  off_t pos = offset;
+
+  if (rio_sendfile(fd, srcfd, &pos, length) < 0) {
+    if (pos == offset && (errno == EINVAL || errno == ENOSYS))
+      return 0;
+    unix_error("Rio_sendfile error");
+  }
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+void build_header(char *header, char *filetype, int filesize, int gzip)
+{
+/*
+ * build_header: 
+ *        builds the complete response header of a static file
+ *        (check the clienterror function for reference)
+ * params:
+ *    - header: output buffer
+ *    - filetype: MIME type of the file
+ *    - filesize: size of the file
+ *    - gzip: the body is the gzip-compressed file
+ * return: void
+ */    
   /// Should consist of a Response line, the server name, the Content-Type
-  /// and the Content-Length
-  sprintf(responseBuffer, "Server: Localhost\r\n");
-  Rio_writen(fd, responseBuffer, strlen(responseBuffer));
-  sprintf(responseBuffer, "Content-Length: %d\r\n", filesize);
-  Rio_writen(fd, responseBuffer, strlen(responseBuffer));
-  sprintf(responseBuffer, "Content-type: %s\r\n\r\n", filetype);
-  Rio_writen(fd, responseBuffer, strlen(responseBuffer));
-
-  /// Send the file content to the client
-  /// Open the file
-  /// Copy it to the srcp buffer
-  /// Write this to the client
-
-  srcfd = Open(filename, O_RDONLY, 0);
-  srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-  Close(srcfd);
-  Rio_writen(fd, srcp, filesize);
-  Munmap(srcp, filesize);
+  /// and the Content-Length. Compressible types also tell caches that the
+  /// body depends on Accept-Encoding.
+  sprintf(header, "HTTP/1.0 200 OK\r\n");
+  sprintf(header + strlen(header), "Server: Localhost\r\n");
+  sprintf(header + strlen(header), "Accept-Ranges: bytes\r\n");
+  if (gzip)
+    sprintf(header + strlen(header), "Content-Encoding: gzip\r\n");
+  if (compressible(filetype))
+    sprintf(header + strlen(header), "Vary: Accept-Encoding\r\n");
+  sprintf(header + strlen(header), "Content-Length: %d\r\n", filesize);
+  sprintf(header + strlen(header), "Content-type: %s\r\n\r\n", filetype);
 }
 
 //-----------------------------------------------------------------------------
@@ -150,44 +456,60 @@ void get_filetype(char *filename, char *filetype)
 /*
  * get_filetype: 
  *        given a filename puts the correct HTTP filetype in the filetype variable 
- *        by the fd argument
+ *        by the fd argument. Unknown extensions are sent as text/plain.
  * params:
  *    - filename: the filename as a path (generated by parse_uri)
  *    - filetype: the MIME type that will be included in the response to the client 
  */
-  if (strstr(filename, ".html"))
-    strcpy(filetype, "text/html");
-  /// Please implement the image filetypes: jpg, png, gif
-  else if (strstr(filename, ".jpg"))
-    strcpy(filetype, "image/jpeg");
-  else if (strstr(filename, ".png"))
-    strcpy(filetype, "image/png");
-  else if (strstr(filename, ".gif"))
-    strcpy(filetype, "image/gif");
-  else
-    strcpy(filetype, "text/plain");
+  /// the extension after the last '.' of the last path component is
+  /// looked up in the perfect hash table generated from mimegen.c
+  char ext[MIME_EXT_SIZE], *dot = strrchr(filename, '.');
+  int i;
+  unsigned int slot;
+
+  strcpy(filetype, "text/plain");
+  if (dot == NULL || strchr(dot, '/') != NULL)
+    return;
+  for (i = 0; dot[i + 1] != '\0'; i++) {
+    if (i == MIME_EXT_SIZE - 1)
+      return;
+    ext[i] = tolower(dot[i + 1]);
+  }
+  ext[i] = '\0';
+
+  slot = mime_hash(ext, MIME_SEED) & (MIME_TABLE_SIZE - 1);
+  if (mime_table[slot].ext != NULL && !strcmp(mime_table[slot].ext, ext))
+    strcpy(filetype, mime_table[slot].type);
 }
 
 //-----------------------------------------------------------------------------
-void print_requesthdrs(rio_t *rp)
+int read_requesthdrs(rio_t *rp, request_hdrs *hdrs)
 {
-/**** DO NOT MODIFY ****/
 /**** WARNING: This will read out everything remaining until a line break ****/
 /* 
- * print_requesthdrs: 
- *        reads out and prints all request lines sent to the server
+ * read_requesthdrs: 
+ *        reads out and prints all request lines sent to the server and
+ *        keeps the headers the server acts on
  * params:
  *    - rp: Rio pointer for reading from file
+ *    - hdrs: (output) the interesting request headers
+ * return: -1 if the read failed or timed out, 0 otherwise
  *
  */
   char buf[MAXLINE];
-  Rio_readlineb(rp, buf, MAXLINE);
-  while(strcmp(buf, "\r\n")) {
+  ssize_t n;
+
+  (*hdrs).range[0] = '\0';
+  (*hdrs).gzip = 0;
+  while((n = rio_readlineb(rp, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n")) {
     printf("%s", buf);
-    Rio_readlineb(rp, buf, MAXLINE);
+    if (!strncasecmp(buf, "Range:", 6))
+      sscanf(buf + 6, " %[^\r\n]", (*hdrs).range);
+    else if (!strncasecmp(buf, "Accept-Encoding:", 16))
+      (*hdrs).gzip = accepts_gzip(buf + 16);
   }
   printf("\n");
-  return;
+  return n < 0 ? -1 : 0;
 }
 
 //-----------------------------------------------------------------------------
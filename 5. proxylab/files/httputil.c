@@ -0,0 +1,188 @@
+#include "httputil.h"
+
+//-----------------------------------------------------------------------------
+int parse_range(char *range, int length, int *first, int *last)
+{
+/*
+ * parse_range:
+ *        resolves the value of a Range request header against an object of
+ *        the given length. Only a single byte range is supported:
+ *        "bytes=a-b", "bytes=a-" and the suffix form "bytes=-n".
+ * params:
+ *    - range: value of the Range header (e.g. "bytes=0-499")
+ *    - length: length of the whole object
+ *    - first, last: (output) the first and last byte of the range
+ * return: 1 if the range is satisfiable,
+ *         0 if the header must be ignored and the whole object sent
+ *           (malformed or multiple ranges),
+ *         -1 if the range lies outside the object (416)
+ */
+  long a, b;
+  char *p, *end;
+
+  if (strncasecmp(range, "bytes=", 6) || strchr(range, ','))
+    return 0;
+  p = range + 6;
+
+  if (*p == '-') {
+    /// suffix range: the last n bytes
+    b = strtol(p + 1, &end, 10);
+    if (end == p + 1 || (*end != '\0' && !isspace(*end)))
+      return 0;
+    if (b == 0 || length == 0)
+      return -1;
+    *first = b > length ? 0 : length - b;
+    *last = length - 1;
+    return 1;
+  }
+
+  a = strtol(p, &end, 10);
+  if (end == p || *end != '-')
+    return 0;
+  p = end + 1;
+  if (*p == '\0' || isspace(*p)) {
+    b = length - 1;
+  } else {
+    b = strtol(p, &end, 10);
+    if (end == p || (*end != '\0' && !isspace(*end)) || b < a)
+      return 0;
+  }
+  if (a >= length)
+    return -1;
+  *first = a;
+  *last = b >= length ? length - 1 : b;
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+void build_range_header(char *buf, char *header, int first, int last, int length)
+{
+/*
+ * build_range_header:
+ *        turns the header of a full (or partial) response into the header
+ *        of a 206 Partial Content response for bytes first..last. The
+ *        status line, Content-Length and Content-Range are replaced, all
+ *        other fields are kept.
+ * params:
+ *    - buf: output buffer, at least strlen(header) + 128 bytes
+ *    - header: the original response header including the empty line
+ *    - first, last: the byte range sent
+ *    - length: length of the whole object
+ */
+  char *line, *eol;
+
+  sprintf(buf, "HTTP/1.0 206 Partial Content\r\n");
+  line = strstr(header, "\r\n");
+  while (line != NULL && strncmp(line, "\r\n\r\n", 4)) {
+    line += 2;
+    eol = strstr(line, "\r\n");
+    if (eol == NULL)
+      break;
+    if (strncasecmp(line, "Content-Length:", 15) &&
+        strncasecmp(line, "Content-Range:", 14))
+      strncat(buf, line, eol - line + 2);
+    line = eol;
+  }
+  sprintf(buf + strlen(buf), "Content-Range: bytes %d-%d/%d\r\n", first, last, length);
+  sprintf(buf + strlen(buf), "Content-Length: %d\r\n\r\n", last - first + 1);
+}
+
+//-----------------------------------------------------------------------------
+int accepts_gzip(char *value)
+{
+/*
+ * accepts_gzip:
+ *        checks whether an Accept-Encoding value allows a gzip body
+ * params:
+ *    - value: value of the Accept-Encoding header (e.g. "gzip, deflate")
+ * return: 1 if gzip (or x-gzip) is listed without q=0, otherwise 0
+ */
+  char buf[MAXLINE], coding[MAXLINE], *item, *save, *q;
+
+  strncpy(buf, value, MAXLINE - 1);
+  buf[MAXLINE - 1] = '\0';
+  for (item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+    coding[0] = '\0';
+    sscanf(item, " %[^; \t\r\n]", coding);
+    if (strcasecmp(coding, "gzip") && strcasecmp(coding, "x-gzip"))
+      continue;
+    q = strstr(item, "q=");
+    return q == NULL || strtod(q + 2, NULL) > 0;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+int header_has_token(char *header, char *name, char *token)
+{
+/*
+ * header_has_token:
+ *        checks whether a response header has a field whose
+ *        comma-separated value contains token (case-insensitive)
+ * params:
+ *    - header: the response header
+ *    - name: field name including the colon (e.g. "Vary:")
+ *    - token: token to look for (e.g. "Accept-Encoding")
+ */
+  char *line = header, value[MAXLINE], *tok, *save;
+  int len = strlen(name);
+
+  while ((line = strstr(line, "\r\n")) != NULL) {
+    line += 2;
+    if (strncasecmp(line, name, len))
+      continue;
+    value[0] = '\0';
+    sscanf(line + len, " %[^\r\n]", value);
+    for (tok = strtok_r(value, ", \t", &save); tok != NULL; tok = strtok_r(NULL, ", \t", &save))
+      if (!strcasecmp(tok, token))
+        return 1;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+int compressible(char *filetype)
+{
+/*
+ * compressible:
+ *        tells whether bodies of a MIME type are worth sending gzipped
+ * params:
+ *    - filetype: the MIME type of the file
+ */
+  return !strncmp(filetype, "text/", 5) || strstr(filetype, "xml") != NULL ||
+         !strcmp(filetype, "application/javascript") ||
+         !strcmp(filetype, "application/json") ||
+         !strcmp(filetype, "application/wasm");
+}
+
+//-----------------------------------------------------------------------------
+int response_compressible(char *header)
+{
+/*
+ * response_compressible:
+ *        compressible() for the Content-Type of a response header; a body
+ *        without a type is not
+ */
+  char *line = header, type[MAXLINE];
+
+  while ((line = strstr(line, "\r\n")) != NULL) {
+    line += 2;
+    if (strncasecmp(line, "Content-Type:", 13) == 0 &&
+        sscanf(line + 13, " %[^;, \r\n]", type) == 1)
+      return compressible(type);
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+void set_read_timeout(int fd, int seconds)
+{
+/*
+ * set_read_timeout:
+ *        bounds every read of a socket: one that gets no data for seconds
+ *        fails with EAGAIN instead of blocking forever (0: no bound)
+ */
+  struct timeval timeout = {seconds, 0};
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
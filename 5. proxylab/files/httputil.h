@@ -0,0 +1,25 @@
+/*
+ * httputil.h - HTTP helpers shared by the web server (http.c) and the
+ *     proxy (proxy.c)
+ */
+#ifndef __HTTPUTIL_H__
+#define __HTTPUTIL_H__
+
+#include "csapp.h"
+
+/// seconds a client may stay silent while sending its request header
+#define HEADER_TIMEOUT 10
+
+/// seconds an origin may keep the proxy (or its prefetcher) waiting for its
+/// next bytes; its connect is bounded by CONNECT_TIMEOUT
+#define ORIGIN_TIMEOUT 30
+
+int parse_range(char *range, int length, int *first, int *last);
+void build_range_header(char *buf, char *header, int first, int last, int length);
+int accepts_gzip(char *value);
+int header_has_token(char *header, char *name, char *token);
+int compressible(char *filetype);
+int response_compressible(char *header);
+void set_read_timeout(int fd, int seconds);
+
+#endif /* __HTTPUTIL_H__ */
@@ -0,0 +1,260 @@
+/*
+ * loadgen.c - HTTP load generator for benchmarking http and proxy
+ *
+ *     Replays a mix of URIs against a web server, directly or through a
+ *     proxy, and reports throughput and latency percentiles.
+ *
+ *     closed loop (default): each of <conns> threads sends its next
+ *         request as soon as the previous response is complete.
+ *     open loop (-r rate): requests are scheduled at a fixed rate no
+ *         matter how fast the server answers. The latency of a request is
+ *         measured from its scheduled start, so time spent queued behind a
+ *         slow response counts (coordinated omission correction).
+ *
+ *     usage: loadgen [-c conns] [-r rate] [-d seconds] [-x proxyhost:port]
+ *                    <host> <port> <uri>...
+ */
+#include "csapp.h"
+
+/// one sample per completed request
+typedef struct {
+  double *latency;      /* seconds */
+  int count;
+  int capacity;
+  long bytes;
+  int errors;
+} samples;
+
+void *worker(void *vargp);
+long fetch(char *request);
+double now(void);
+void wait_until(double t);
+void record(samples *s, double latency);
+int compare_double(const void *a, const void *b);
+void usage(char *prog);
+
+/// target and load parameters, set once by main
+struct sockaddr_in target;          /* the proxy if -x was given, else the server */
+char **requests;                    /* prebuilt request of every uri */
+int num_uris;
+int conns = 1;
+double rate = 0;                    /* requests per second, 0: closed loop */
+double duration = 10;
+double start_time;
+
+/// index of the next request, shared by the workers
+volatile long next_request = 0;
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  int c, i, j, proxyport = 0, port, total = 0, errors = 0;
+  char *proxyhost = NULL, *colon, buf[MAXLINE];
+  long bytes = 0;
+  double elapsed, *all;
+  struct hostent *hp;
+  pthread_t *tids;
+  samples *results;
+
+  while ((c = getopt(argc, argv, "c:r:d:x:")) != EOF) {
+    switch (c) {
+      case 'c':             /* number of concurrent connections */
+        conns = atoi(optarg);
+        break;
+      case 'r':             /* open loop at this many requests per second */
+        rate = atof(optarg);
+        break;
+      case 'd':             /* run time in seconds */
+        duration = atof(optarg);
+        break;
+      case 'x':             /* send requests through this proxy */
+        proxyhost = optarg;
+        if ((colon = strchr(optarg, ':')) == NULL)
+          usage(argv[0]);
+        *colon = '\0';
+        proxyport = atoi(colon + 1);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind < 3 || conns < 1 || duration <= 0)
+    usage(argv[0]);
+  port = atoi(argv[optind + 1]);
+
+  /// resolve once up front; gethostbyname() is not thread-safe
+  hp = Gethostbyname(proxyhost ? proxyhost : argv[optind]);
+  bzero(&target, sizeof(target));
+  target.sin_family = AF_INET;
+  bcopy(hp->h_addr_list[0], &target.sin_addr.s_addr, hp->h_length);
+  target.sin_port = htons(proxyhost ? proxyport : port);
+
+  /// a proxy gets absolute URIs
+  num_uris = argc - optind - 2;
+  requests = Malloc(num_uris * sizeof(char *));
+  for (i = 0; i < num_uris; i++) {
+    if (proxyhost)
+      sprintf(buf, "GET http://%s:%d%s HTTP/1.0\r\n\r\n", argv[optind], port, argv[optind + 2 + i]);
+    else
+      sprintf(buf, "GET %s HTTP/1.0\r\n\r\n", argv[optind + 2 + i]);
+    requests[i] = strdup(buf);
+  }
+  Signal(SIGPIPE, SIG_IGN);
+
+  tids = Malloc(conns * sizeof(pthread_t));
+  results = Calloc(conns, sizeof(samples));
+  start_time = now();
+  for (i = 0; i < conns; i++)
+    Pthread_create(&tids[i], NULL, worker, &results[i]);
+  for (i = 0; i < conns; i++)
+    Pthread_join(tids[i], NULL);
+  elapsed = now() - start_time;
+
+  /// merge the samples of all workers
+  for (i = 0; i < conns; i++)
+    total += results[i].count;
+  all = Malloc((total + 1) * sizeof(double));
+  for (i = 0, total = 0; i < conns; i++) {
+    for (j = 0; j < results[i].count; j++)
+      all[total++] = results[i].latency[j];
+    bytes += results[i].bytes;
+    errors += results[i].errors;
+  }
+  qsort(all, total, sizeof(double), compare_double);
+
+  if (rate > 0)
+    printf("open loop: %.1f req/s offered, %d connections\n", rate, conns);
+  else
+    printf("closed loop: %d connections\n", conns);
+  printf("requests %d  errors %d  time %.2f s\n", total, errors, elapsed);
+  printf("throughput %.1f req/s  %.2f MB/s\n", total / elapsed, bytes / 1e6 / elapsed);
+  if (total > 0)
+    printf("latency ms  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           all[(int)(total * 0.50)] * 1e3, all[(int)(total * 0.90)] * 1e3,
+           all[(int)(total * 0.99)] * 1e3, all[(int)(total * 0.999)] * 1e3,
+           all[total - 1] * 1e3);
+  exit(0);
+}
+
+//-----------------------------------------------------------------------------
+void *worker(void *vargp)
+{
+/*
+ * worker:
+ *        sends requests until the run time is over and records their
+ *        latency in its own sample buffer
+ */
+  samples *s = vargp;
+  long i, n;
+  double begin;
+
+  while (1) {
+    i = __sync_fetch_and_add(&next_request, 1);
+    if (rate > 0) {
+      /// open loop: request i is due at start + i / rate
+      begin = start_time + i / rate;
+      if (begin - start_time >= duration)
+        break;
+      wait_until(begin);
+    } else {
+      begin = now();
+      if (begin - start_time >= duration)
+        break;
+    }
+
+    if ((n = fetch(requests[i % num_uris])) < 0) {
+      (*s).errors++;
+      continue;
+    }
+    (*s).bytes += n;
+    record(s, now() - begin);
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+long fetch(char *request)
+{
+/*
+ * fetch:
+ *        sends one request over a new connection and reads the response
+ * return: number of body bytes received, -1 on error or a non-2xx status
+ */
+  char buf[MAXBUF];
+  int fd, status = 0;
+  long length = 0;
+  ssize_t n;
+  rio_t rio;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  if (connect(fd, (SA *)&target, sizeof(target)) < 0 ||
+      rio_writen(fd, request, strlen(request)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  rio_readinitb(&rio, fd);
+  if (rio_readlineb(&rio, buf, MAXLINE) <= 0 || sscanf(buf, "%*s %d", &status) != 1) {
+    close(fd);
+    return -1;
+  }
+  do {
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+      close(fd);
+      return -1;
+    }
+  } while (strcmp(buf, "\r\n"));
+  while ((n = rio_readnb(&rio, buf, MAXBUF)) > 0)
+    length += n;
+
+  close(fd);
+  if (n < 0 || status < 200 || status >= 300)
+    return -1;
+  return length;
+}
+
+//-----------------------------------------------------------------------------
+void record(samples *s, double latency)
+{
+  if ((*s).count == (*s).capacity) {
+    (*s).capacity = (*s).capacity ? 2 * (*s).capacity : 1024;
+    (*s).latency = Realloc((*s).latency, (*s).capacity * sizeof(double));
+  }
+  (*s).latency[(*s).count++] = latency;
+}
+
+double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void wait_until(double t)
+{
+  double d = t - now();
+  struct timespec ts;
+
+  if (d <= 0)
+    return;
+  ts.tv_sec = (time_t)d;
+  ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+void usage(char *prog)
+{
+  fprintf(stderr, "usage: %s [-c conns] [-r rate] [-d seconds] [-x proxyhost:port] "
+          "<host> <port> <uri>...\n", prog);
+  exit(1);
+}
@@ -0,0 +1,147 @@
+#include "lz.h"
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+// hash of the 4 bytes at p
+static unsigned int lz_hash(unsigned char *p)
+{
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// write a length past the 4 bits of the token as a run of 255s
+static int put_length(unsigned char *dst, int pos, int capacity, int n)
+{
+  for (; n >= 255; n -= 255)
+  {
+    if (pos >= capacity)
+      return -1;
+    dst[pos++] = 255;
+  }
+  if (pos >= capacity)
+    return -1;
+  dst[pos++] = n;
+  return pos;
+}
+
+// append a sequence: literals, then a match unless matchLength is 0
+static int put_sequence(unsigned char *dst, int pos, int capacity, unsigned char *literals,
+                        int literalLength, int offset, int matchLength)
+{
+  int m = matchLength ? matchLength - MIN_MATCH : 0;
+
+  if (pos >= capacity)
+    return -1;
+  dst[pos++] = (literalLength < 15 ? literalLength : 15) << 4 | (m < 15 ? m : 15);
+  if (literalLength >= 15 && (pos = put_length(dst, pos, capacity, literalLength - 15)) < 0)
+    return -1;
+  if (pos + literalLength > capacity)
+    return -1;
+  memcpy(dst + pos, literals, literalLength);
+  pos += literalLength;
+  if (matchLength == 0)
+    return pos;
+
+  if (pos + 2 > capacity)
+    return -1;
+  dst[pos++] = offset & 0xff;
+  dst[pos++] = offset >> 8;
+  if (m >= 15 && (pos = put_length(dst, pos, capacity, m - 15)) < 0)
+    return -1;
+  return pos;
+}
+
+int lz_compress(char *src, int length, char *dst, int capacity)
+{
+/*
+ * lz_compress:
+ *        compresses length bytes of src into dst
+ * params:
+ *    - capacity: size of dst
+ * return: the compressed length, 0 if it does not fit in capacity
+ */
+  unsigned char *s = (unsigned char *)src, *d = (unsigned char *)dst;
+  int table[1 << HASH_BITS];
+  int i = 0, anchor = 0, pos = 0, candidate, match;
+  unsigned int h;
+
+  memset(table, 0, sizeof(table));
+  while (i + MIN_MATCH <= length)
+  {
+    h = lz_hash(s + i);
+    candidate = table[h] - 1;       /// positions are stored + 1, 0 is empty
+    table[h] = i + 1;
+    if (candidate < 0 || i - candidate > MAX_OFFSET || memcmp(s + candidate, s + i, MIN_MATCH))
+    {
+      i++;
+      continue;
+    }
+
+    match = MIN_MATCH;
+    while (i + match < length && s[candidate + match] == s[i + match])
+      match++;
+    if ((pos = put_sequence(d, pos, capacity, s + anchor, i - anchor, i - candidate, match)) < 0)
+      return 0;
+    i += match;
+    anchor = i;
+  }
+  if ((pos = put_sequence(d, pos, capacity, s + anchor, length - anchor, 0, 0)) < 0)
+    return 0;
+  return pos;
+}
+
+int lz_decompress(char *src, int length, char *dst, int capacity)
+{
+/*
+ * lz_decompress:
+ *        expands the output of lz_compress; every length and offset is
+ *        checked against the buffers
+ * params:
+ *    - capacity: size of dst
+ * return: the expanded length, -1 if src is malformed or too big for dst
+ */
+  unsigned char *s = (unsigned char *)src, *d = (unsigned char *)dst;
+  int ip = 0, op = 0, literals, match, offset, b;
+
+  while (ip < length)
+  {
+    literals = s[ip] >> 4;
+    match = (s[ip++] & 15) + MIN_MATCH;
+    if (literals == 15)
+      do
+      {
+        if (ip >= length)
+          return -1;
+        literals += b = s[ip++];
+      } while (b == 255);
+    if (ip + literals > length || op + literals > capacity)
+      return -1;
+    memcpy(d + op, s + ip, literals);
+    ip += literals;
+    op += literals;
+    if (ip == length)
+      break;                        /// the last sequence has no match
+
+    if (ip + 2 > length)
+      return -1;
+    offset = s[ip] | s[ip + 1] << 8;
+    ip += 2;
+    if (match == 15 + MIN_MATCH)
+      do
+      {
+        if (ip >= length)
+          return -1;
+        match += b = s[ip++];
+      } while (b == 255);
+    if (offset == 0 || offset > op || op + match > capacity)
+      return -1;
+    /// the match may overlap the bytes it produces: copy byte by byte
+    for (; match > 0; match--, op++)
+      d[op] = d[op - offset];
+  }
+  return op;
+}
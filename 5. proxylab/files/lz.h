@@ -0,0 +1,17 @@
+/*
+ * lz.h - a small LZ77 codec for text bodies kept in the proxy cache
+ *
+ * The format follows the LZ4 block format: a sequence is a token byte
+ * (4 bits of literal length, 4 bits of match length - 4, 15 meaning more
+ * length bytes follow), the literals, then a 2-byte little-endian offset
+ * back into the output. The last sequence has literals only. Matches are
+ * found through a hash table of 4-byte prefixes, one probe per position,
+ * which trades ratio for speed: text compresses 2-4x at memory speed.
+ */
+#ifndef __LZ_H__
+#define __LZ_H__
+
+int lz_compress(char *src, int length, char *dst, int capacity);
+int lz_decompress(char *src, int length, char *dst, int capacity);
+
+#endif /* __LZ_H__ */
@@ -0,0 +1,103 @@
+/*
+ * mimegen.c - generates mimetab.h, a perfect hash table from file
+ *     extensions to MIME types used by get_filetype() in http.c.
+ *
+ *     To serve a new type, add it to the list below; make regenerates the
+ *     table. The generator picks the smallest power-of-two table and a
+ *     seed for which mime_hash() has no collisions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mimehash.h"
+
+struct mime {
+  const char *ext;
+  const char *type;
+};
+
+static const struct mime types[] = {
+  { "html", "text/html" },
+  { "htm", "text/html" },
+  { "css", "text/css" },
+  { "js", "application/javascript" },
+  { "mjs", "application/javascript" },
+  { "json", "application/json" },
+  { "xml", "application/xml" },
+  { "txt", "text/plain" },
+  { "csv", "text/csv" },
+  { "md", "text/markdown" },
+  { "jpg", "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "png", "image/png" },
+  { "gif", "image/gif" },
+  { "webp", "image/webp" },
+  { "avif", "image/avif" },
+  { "svg", "image/svg+xml" },
+  { "ico", "image/x-icon" },
+  { "bmp", "image/bmp" },
+  { "tif", "image/tiff" },
+  { "tiff", "image/tiff" },
+  { "mp4", "video/mp4" },
+  { "webm", "video/webm" },
+  { "ogg", "audio/ogg" },
+  { "mp3", "audio/mpeg" },
+  { "wav", "audio/wav" },
+  { "pdf", "application/pdf" },
+  { "zip", "application/zip" },
+  { "gz", "application/gzip" },
+  { "tar", "application/x-tar" },
+  { "wasm", "application/wasm" },
+  { "woff", "font/woff" },
+  { "woff2", "font/woff2" },
+  { "ttf", "font/ttf" },
+  { "otf", "font/otf" },
+};
+
+#define NTYPES (sizeof(types) / sizeof(types[0]))
+#define MAX_SEED 1000000
+
+//-----------------------------------------------------------------------------
+int main(void)
+{
+  unsigned int size, seed, i, slot;
+  int used[1024];
+
+  for (i = 0; i < NTYPES; i++) {
+    if (strlen(types[i].ext) >= MIME_EXT_SIZE) {
+      fprintf(stderr, "mimegen: extension %s is too long\n", types[i].ext);
+      exit(1);
+    }
+  }
+
+  /// smallest table (at least twice the entries) with a collision-free seed
+  for (size = 2; size < 2 * NTYPES; size *= 2)
+    ;
+  for (; size <= 1024; size *= 2) {
+    for (seed = 1; seed < MAX_SEED; seed++) {
+      memset(used, -1, sizeof(used));
+      for (i = 0; i < NTYPES; i++) {
+        slot = mime_hash(types[i].ext, seed) & (size - 1);
+        if (used[slot] >= 0)
+          break;
+        used[slot] = i;
+      }
+      if (i == NTYPES)
+        goto found;
+    }
+  }
+  fprintf(stderr, "mimegen: no perfect hash found\n");
+  exit(1);
+
+found:
+  printf("/* mimetab.h - generated by mimegen.c, do not edit */\n");
+  printf("#define MIME_SEED %uu\n", seed);
+  printf("#define MIME_TABLE_SIZE %u\n\n", size);
+  printf("static const struct { const char *ext; const char *type; } "
+         "mime_table[MIME_TABLE_SIZE] = {\n");
+  for (slot = 0; slot < size; slot++)
+    if (used[slot] >= 0)
+      printf("  [%u] = { \"%s\", \"%s\" },\n", slot, types[used[slot]].ext, types[used[slot]].type);
+  printf("};\n");
+  return 0;
+}
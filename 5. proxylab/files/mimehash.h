@@ -0,0 +1,23 @@
+/*
+ * mimehash.h - hash function of the MIME type table. Shared by the table
+ *     generator (mimegen.c) and the web server (http.c), which must agree
+ *     on it for the generated table to be a perfect hash.
+ */
+#ifndef __MIMEHASH_H__
+#define __MIMEHASH_H__
+
+#define MIME_EXT_SIZE 16    /* longest extension + 1 */
+
+/* seeded FNV-1a over a lowercase extension */
+static inline unsigned int mime_hash(const char *ext, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ seed;
+
+    while (*ext) {
+	h ^= (unsigned char)*ext++;
+	h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+#endif /* __MIMEHASH_H__ */
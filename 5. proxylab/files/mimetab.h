@@ -0,0 +1,41 @@
+/* mimetab.h - generated by mimegen.c, do not edit */
+#define MIME_SEED 95u
+#define MIME_TABLE_SIZE 128
+
+static const struct { const char *ext; const char *type; } mime_table[MIME_TABLE_SIZE] = {
+  [4] = { "avif", "image/avif" },
+  [5] = { "gz", "application/gzip" },
+  [9] = { "ico", "image/x-icon" },
+  [12] = { "wav", "audio/wav" },
+  [15] = { "tif", "image/tiff" },
+  [16] = { "css", "text/css" },
+  [18] = { "woff", "font/woff" },
+  [25] = { "tiff", "image/tiff" },
+  [31] = { "bmp", "image/bmp" },
+  [32] = { "svg", "image/svg+xml" },
+  [34] = { "woff2", "font/woff2" },
+  [38] = { "pdf", "application/pdf" },
+  [39] = { "html", "text/html" },
+  [46] = { "wasm", "application/wasm" },
+  [47] = { "htm", "text/html" },
+  [50] = { "tar", "application/x-tar" },
+  [55] = { "gif", "image/gif" },
+  [64] = { "mp4", "video/mp4" },
+  [70] = { "xml", "application/xml" },
+  [71] = { "md", "text/markdown" },
+  [72] = { "txt", "text/plain" },
+  [75] = { "csv", "text/csv" },
+  [77] = { "ogg", "audio/ogg" },
+  [83] = { "ttf", "font/ttf" },
+  [84] = { "zip", "application/zip" },
+  [88] = { "js", "application/javascript" },
+  [91] = { "otf", "font/otf" },
+  [95] = { "webm", "video/webm" },
+  [105] = { "mjs", "application/javascript" },
+  [106] = { "jpeg", "image/jpeg" },
+  [117] = { "mp3", "audio/mpeg" },
+  [118] = { "jpg", "image/jpeg" },
+  [122] = { "png", "image/png" },
+  [126] = { "json", "application/json" },
+  [127] = { "webp", "image/webp" },
+};
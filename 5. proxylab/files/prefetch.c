@@ -0,0 +1,288 @@
+#include "prefetch.h"
+#include "httputil.h"
+
+/// the proxy cache (a shard or the shared cache of the worker processes)
+static is_cached_t is_cached;
+static store_t store;
+
+/// ring of URIs waiting to be fetched
+static char queue[PREFETCH_QUEUE][URI_SIZE];
+static int queue_head = 0, queue_count = 0;
+static sem_t queue_mutex;       // protects the ring
+static sem_t queue_items;       // number of queued URIs
+
+static void *prefetch_thread(void *vargp);
+static void prefetch(char *uri);
+static int connect_uri(char *uri);
+static int resolve_link(char *page, char *ref, char *uri);
+static void remove_dot_segments(char *uri);
+static int tag_attribute(char *tag, char *name, char *value);
+
+void prefetch_init(is_cached_t isCached, store_t storeResponse)
+{
+/*
+ * prefetch_init:
+ *        starts the prefetch threads
+ * params:
+ *    - isCached: tells if a URI needs no prefetching
+ *    - storeResponse: adds a prefetched response to the cache
+ */
+  pthread_t tid;
+  int i;
+
+  is_cached = isCached;
+  store = storeResponse;
+  Sem_init(&queue_mutex, 0, 1);
+  Sem_init(&queue_items, 0, 0);
+  for (i = 0; i < PREFETCH_THREADS; i++) {
+    Pthread_create(&tid, NULL, prefetch_thread, NULL);
+    Pthread_detach(tid);
+  }
+}
+
+void prefetch_links(char *page, char *html, int length)
+{
+/*
+ * prefetch_links:
+ *        queues the embedded resources of an HTML page. Never blocks: links
+ *        that do not fit in the queue are dropped.
+ * params:
+ *    - page: absolute URI of the page, for relative links
+ *    - html: the page (not NUL terminated)
+ *    - length: length of html
+ */
+  char tag[MAXLINE], value[MAXLINE], uri[MAXLINE];
+  char *p, *end = html + length, *close;
+  int tagLength;
+
+  for (p = html; p < end; p++) {
+    if (*p != '<')
+      continue;
+    if ((close = memchr(p, '>', end - p)) == NULL)
+      break;
+    tagLength = close - p - 1;
+    if (tagLength >= MAXLINE) {
+      p = close;
+      continue;
+    }
+    memcpy(tag, p + 1, tagLength);
+    tag[tagLength] = '\0';
+    p = close;
+
+    /// <img src=...> and <link href=...>
+    if (!((!strncasecmp(tag, "img", 3) && isspace(tag[3]) && tag_attribute(tag, "src", value)) ||
+          (!strncasecmp(tag, "link", 4) && isspace(tag[4]) && tag_attribute(tag, "href", value))))
+      continue;
+    if (!resolve_link(page, value, uri))
+      continue;
+
+    P(&queue_mutex);
+    if (queue_count < PREFETCH_QUEUE) {
+      strcpy(queue[(queue_head + queue_count) % PREFETCH_QUEUE], uri);
+      queue_count++;
+      V(&queue_items);
+    }
+    V(&queue_mutex);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void *prefetch_thread(void *vargp)
+{
+  char uri[URI_SIZE];
+
+  while (1) {
+    P(&queue_items);
+    P(&queue_mutex);
+    strcpy(uri, queue[queue_head]);
+    queue_head = (queue_head + 1) % PREFETCH_QUEUE;
+    queue_count--;
+    V(&queue_mutex);
+
+    prefetch(uri);
+  }
+  return NULL;
+}
+
+static void prefetch(char *uri)
+{
+/*
+ * prefetch:
+ *        fetches uri into the cache unless it is cached already. Only a
+ *        complete 200 response small enough for the cache is kept. Errors
+ *        just abandon the fetch; the client will retry through the proxy.
+ */
+  char line[MAXLINE], host[MAXLINE], response[RESP_SIZE], *content;
+  int fd, status = 0, contentLength = -1, responseLength = 0, lineLength;
+  rio_t rio;
+
+  if (is_cached(uri) || (fd = connect_uri(uri)) < 0)
+    return;
+
+  sscanf(uri, "http://%[^/]", host);
+  lineLength = snprintf(line, MAXLINE, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", uri, host);
+  if (lineLength >= MAXLINE || rio_writen(fd, line, lineLength) < 0) {
+    close(fd);
+    return;
+  }
+
+  rio_readinitb(&rio, fd);
+  if (rio_readlineb(&rio, line, MAXLINE) <= 0) {
+    close(fd);
+    return;
+  }
+  sscanf(line, "%*s %d", &status);
+  while (strcmp(line, "\r\n")) {
+    if (!strncasecmp(line, "Content-Length:", 15))
+      contentLength = atoi(line + 15);
+    lineLength = strlen(line);
+    if (responseLength + lineLength + 3 > RESP_SIZE)
+      status = 0;
+    else {
+      memcpy(response + responseLength, line, lineLength);
+      responseLength += lineLength;
+    }
+    if (rio_readlineb(&rio, line, MAXLINE) <= 0) {
+      close(fd);
+      return;
+    }
+  }
+  strcpy(response + responseLength, "\r\n");
+
+  if (status != 200 || contentLength < 0 ||
+      sizeof(cache_block) + contentLength > MAX_OBJECT_SIZE) {
+    close(fd);
+    return;
+  }
+  content = Malloc(contentLength + 1);
+  if (rio_readnb(&rio, content, contentLength) == contentLength)
+    store(uri, content, response, contentLength);
+  free(content);
+  close(fd);
+}
+
+static int connect_uri(char *uri)
+{
+/*
+ * connect_uri:
+ *        connects to the origin of an absolute http URI; an origin that
+ *        stalls fails a read after ORIGIN_TIMEOUT instead of holding a
+ *        prefetch thread for good
+ * return: connected socket, -1 on error
+ */
+  char host[MAXLINE];
+  int port = 80, fd;
+
+  if (sscanf(uri, "http://%[^/:]:%d", host, &port) < 1)
+    return -1;
+  if ((fd = open_clientfd_r(host, port)) < 0)
+    return -1;
+  set_read_timeout(fd, ORIGIN_TIMEOUT);
+  return fd;
+}
+
+//-----------------------------------------------------------------------------
+static int resolve_link(char *page, char *ref, char *uri)
+{
+/*
+ * resolve_link:
+ *        makes an absolute http URI of a link found in page
+ * return: 1 on success, 0 if the link is not prefetched (other schemes,
+ *         fragments, too long)
+ */
+  char base[MAXLINE], *slash, *p;
+
+  if ((p = strchr(ref, '#')) != NULL)
+    *p = '\0';
+  if (ref[0] == '\0' || strlen(page) + strlen(ref) + 6 >= URI_SIZE)
+    return 0;
+
+  if (!strncasecmp(ref, "http://", 7)) {
+    strcpy(uri, ref);
+  } else if (!strncmp(ref, "//", 2)) {
+    sprintf(uri, "http:%s", ref);
+  } else if ((p = strchr(ref, ':')) != NULL && (slash = strchr(ref, '/'), slash == NULL || p < slash)) {
+    return 0;       /* https:, data:, javascript:, ... */
+  } else if (ref[0] == '/') {
+    /// the origin of the page: "http://host[:port]"
+    strcpy(base, page);
+    if ((slash = strchr(base + 7, '/')) != NULL)
+      *slash = '\0';
+    sprintf(uri, "%s%s", base, ref);
+  } else {
+    /// the directory of the page
+    strcpy(base, page);
+    if ((slash = strrchr(base + 7, '/')) != NULL)
+      slash[1] = '\0';
+    else
+      strcat(base, "/");
+    sprintf(uri, "%s%s", base, ref);
+  }
+  remove_dot_segments(uri);
+  return strcmp(uri, page) != 0;
+}
+
+// drop the "." and ".." segments of the path of an absolute http URI, so
+// "http://h/a/b/../c.png" becomes "http://h/a/c.png" (RFC 3986 5.2.4)
+static void remove_dot_segments(char *uri)
+{
+  char out[MAXLINE], *path, *seg, *next, *query;
+  int n = 0, length;
+
+  if ((path = strchr(uri + 7, '/')) == NULL)
+    return;
+  query = path + strcspn(path, "?");
+  for (seg = path; seg < query; seg = next) {
+    /// seg is a "/" and the segment after it, up to the next one
+    next = seg + 1 + strcspn(seg + 1, "/?");
+    length = next - seg - 1;
+    if (length == 2 && !strncmp(seg + 1, "..", 2)) {
+      while (n > 0 && out[--n] != '/')
+        ;
+    } else if (!(length == 1 && seg[1] == '.')) {
+      memcpy(out + n, seg, next - seg);
+      n += next - seg;
+      continue;
+    }
+    /// a dot segment at the end leaves its directory
+    if (next == query)
+      out[n++] = '/';
+  }
+  if (n == 0)
+    out[n++] = '/';
+  strcpy(out + n, query);
+  strcpy(path, out);
+}
+
+static int tag_attribute(char *tag, char *name, char *value)
+{
+/*
+ * tag_attribute:
+ *        finds the value of an attribute in the text of a tag, quoted or not
+ * return: 1 if found
+ */
+  int len = strlen(name);
+  char *p;
+
+  value[0] = '\0';
+  for (p = tag; *p; p++) {
+    if (!isspace(*p) || strncasecmp(p + 1, name, len))
+      continue;
+    p += len + 1;
+    while (isspace(*p))
+      p++;
+    if (*p != '=')
+      continue;
+    p++;
+    while (isspace(*p))
+      p++;
+    if (*p == '"')
+      sscanf(p + 1, "%[^\"]", value);
+    else if (*p == '\'')
+      sscanf(p + 1, "%[^']", value);
+    else
+      sscanf(p, "%[^ \t\r\n>]", value);
+    return value[0] != '\0';
+  }
+  return 0;
+}
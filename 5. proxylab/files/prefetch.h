@@ -0,0 +1,26 @@
+/*
+ * prefetch.h - link prefetching for the proxy (proxy.c)
+ *
+ * HTML pages relayed by the proxy are scanned for the resources a browser
+ * will ask for next (<img src>, <link href>). Those URIs are queued and
+ * background threads fetch them from the origin into the proxy cache, so
+ * the follow-up requests of the page are hits.
+ */
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define PREFETCH_THREADS 2
+#define PREFETCH_QUEUE 64         // pending URIs; more links are dropped
+
+/// the proxy cache as the prefetcher uses it: is a URI cached, and add a
+/// complete 200 response of it
+typedef int (*is_cached_t)(char *uri);
+typedef void (*store_t)(char *uri, char *content, char *response, int contentLength);
+
+void prefetch_init(is_cached_t isCached, store_t store);
+void prefetch_links(char *page, char *html, int length);
+
+#endif /* __PREFETCH_H__ */
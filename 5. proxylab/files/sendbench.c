@@ -0,0 +1,102 @@
+/*
+ * sendbench.c - measures how fast the static server delivers one file
+ *     and, given the server's pid, how much server CPU time it spends per
+ *     GB sent. Used to compare the mmap and sendfile delivery modes of http.
+ *
+ *     usage: sendbench <host> <port> <uri> <requests> [server pid]
+ */
+#include "csapp.h"
+
+double server_cpu(int pid);
+long fetch(char *host, int port, char *uri);
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  int port, requests, pid = 0, i;
+  long bytes = 0;
+  double elapsed, cpu = 0, gb;
+  struct timeval start, end;
+
+  if (argc != 5 && argc != 6) {
+    fprintf(stderr, "usage: %s <host> <port> <uri> <requests> [server pid]\n", argv[0]);
+    exit(1);
+  }
+  port = atoi(argv[2]);
+  requests = atoi(argv[4]);
+  if (argc == 6)
+    pid = atoi(argv[5]);
+
+  /// warm the server's file cache and the page cache first
+  fetch(argv[1], port, argv[3]);
+
+  if (pid)
+    cpu = -server_cpu(pid);
+  gettimeofday(&start, NULL);
+  for (i = 0; i < requests; i++)
+    bytes += fetch(argv[1], port, argv[3]);
+  gettimeofday(&end, NULL);
+  if (pid)
+    cpu += server_cpu(pid);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  gb = bytes / 1e9;
+  printf("%-24s %6d requests %9.1f MB %8.3f s %9.1f MB/s",
+         argv[3], requests, bytes / 1e6, elapsed, bytes / 1e6 / elapsed);
+  if (pid)
+    printf("   server cpu %7.3f s  %7.3f s/GB", cpu, cpu / gb);
+  printf("\n");
+  exit(0);
+}
+
+//-----------------------------------------------------------------------------
+long fetch(char *host, int port, char *uri)
+{
+/*
+ * fetch:
+ *        requests uri over a new connection and reads the whole response
+ * return: number of body bytes received
+ */
+  char buf[MAXBUF];
+  long length = 0;
+  ssize_t n;
+  rio_t rio;
+  int fd = Open_clientfd(host, port);
+
+  sprintf(buf, "GET %s HTTP/1.0\r\n\r\n", uri);
+  Rio_writen(fd, buf, strlen(buf));
+
+  Rio_readinitb(&rio, fd);
+  do {
+    if (Rio_readlineb(&rio, buf, MAXLINE) == 0)
+      app_error("fetch: connection closed in the response header");
+  } while (strcmp(buf, "\r\n"));
+  while ((n = Rio_readnb(&rio, buf, MAXBUF)) > 0)
+    length += n;
+
+  Close(fd);
+  return length;
+}
+
+//-----------------------------------------------------------------------------
+double server_cpu(int pid)
+{
+/*
+ * server_cpu:
+ *        reads the user + system CPU time consumed so far by process pid
+ * return: CPU time in seconds
+ */
+  char path[64], buf[MAXLINE], *p;
+  unsigned long utime, stime;
+  FILE *fp;
+
+  sprintf(path, "/proc/%d/stat", pid);
+  fp = Fopen(path, "r");
+  Fgets(buf, MAXLINE, fp);
+  Fclose(fp);
+
+  /// skip "pid (comm) state" and the ten fields before utime
+  p = strrchr(buf, ')');
+  sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
@@ -0,0 +1,238 @@
+#include "shmcache.h"
+#include "httputil.h"
+
+/// the tail is read and advanced by several processes at once
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+// FNV-1a hash of a uri and its variant (gzip or identity)
+static unsigned long long shm_key(char *uri, int gzip)
+{
+  unsigned long long h = 14695981039346656037ull;
+  while (*uri)
+  {
+    h ^= (unsigned char)*uri++;
+    h *= 1099511628211ull;
+  }
+  h ^= gzip;
+  h *= 1099511628211ull;
+  return h ^ (h >> 29);
+}
+
+// are the bytes at log position off still in the arena
+static int shm_valid(shm_cache *cache, unsigned long long off)
+{
+  return load_acquire(&(*cache).tail) - off <= (*cache).size;
+}
+
+shm_cache *shm_cache_init(int size)
+{
+/*
+ * shm_cache_init:
+ *        map an empty cache that forked children share
+ * params:
+ *    - size: bytes of the object arena (the cache budget of all processes)
+ */
+  shm_cache *cache = Mmap(NULL, sizeof(shm_cache) + size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  memset(cache, 0, sizeof(shm_cache));
+  (*cache).size = size;
+  Sem_init(&(*cache).mutex, 1, 1);
+  return cache;
+}
+
+// copy the object of uri and variant gzip out of the arena, NULL if none
+static cache_block *shm_copy(shm_cache *cache, char *uri, int gzip)
+{
+  unsigned long long key = shm_key(uri, gzip), slot, off;
+  unsigned long long *bucket = (*cache).slots[key % SHM_BUCKETS];
+  shm_object obj;
+  cache_block *block;
+  char *p;
+  int w;
+
+  for (w = 0; w < SHM_WAYS; w++)
+  {
+    if ((slot = load_acquire(&bucket[w])) == 0)
+      continue;
+    off = slot - 1;
+    p = (*cache).arena + off % (*cache).size;
+    memcpy(&obj, p, sizeof(obj));
+    if (!shm_valid(cache, off) || obj.key != key || obj.uriLength >= URI_SIZE ||
+        obj.respLength >= RESP_SIZE || obj.contentLength < 0 || obj.size > (*cache).size)
+      continue;
+
+    block = malloc(sizeof(cache_block));
+    memcpy((*block).uri, p + sizeof(obj), obj.uriLength + 1);
+    memcpy((*block).resp, p + sizeof(obj) + obj.uriLength + 1, obj.respLength + 1);
+    (*block).content = malloc(obj.contentLength + 1);
+    (*block).blob = NULL;
+    (*block).compressedLength = 0;
+    memcpy((*block).content, p + sizeof(obj) + obj.uriLength + obj.respLength + 2,
+           obj.contentLength);
+
+    /// the copy is good if the writers did not reach it meanwhile
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!shm_valid(cache, off) || strcmp((*block).uri, uri))
+    {
+      shm_block_free(block);
+      continue;
+    }
+    (*block).contentLength = obj.contentLength;
+    (*block).offset = 0;
+    (*block).totalLength = obj.contentLength;
+    (*block).gzip = obj.gzip;
+    (*block).vary = obj.vary;
+    (*block).expires = 0;
+    (*block).refs = 1;
+    (*block).prev = (*block).next = NULL;
+    return block;
+  }
+  return NULL;
+}
+
+cache_block *shm_cache_find(shm_cache *cache, char *uri, int acceptGzip)
+{
+/*
+ * shm_cache_find:
+ *        look up a complete object without taking a lock. A client that
+ *        accepts gzip gets the gzip variant, or the identity one if the
+ *        origin does not vary it on Accept-Encoding.
+ * params:
+ *    - cache: the shared cache
+ *    - uri: uri string
+ *    - acceptGzip: the client accepts gzip
+ * return: a private copy of the block, to be freed with shm_block_free()
+ *    or cache_release(), or NULL
+ */
+  cache_block *block = NULL;
+
+  if (acceptGzip)
+  {
+    block = shm_copy(cache, uri, 1);
+    if (block == NULL && (block = shm_copy(cache, uri, 0)) != NULL && (*block).vary)
+    {
+      shm_block_free(block);
+      block = NULL;
+    }
+  }
+  else
+  {
+    block = shm_copy(cache, uri, 0);
+  }
+  __atomic_fetch_add(block != NULL ? &(*cache).hits : &(*cache).misses, 1, __ATOMIC_RELAXED);
+  return block;
+}
+
+// is the identity variant of uri cached; not counted as a hit or miss
+int shm_cache_has(shm_cache *cache, char *uri)
+{
+  cache_block *block = shm_copy(cache, uri, 0);
+
+  if (block == NULL)
+    return 0;
+  shm_block_free(block);
+  return 1;
+}
+
+int shm_cache_add(shm_cache *cache, char *uri, char *content, char *response, int contentLength)
+{
+/*
+ * shm_cache_add:
+ *        append a complete object to the log and index it. The space is
+ *        claimed by advancing the tail before the bytes are written, so a
+ *        reader of the objects being overwritten sees them as gone.
+ * params:
+ *    - cache: the shared cache
+ *    - uri: uri string
+ *    - content: the body
+ *    - response: response header
+ *    - contentLength: byte length of the body
+ * return: 1 if added, 0 if the object does not fit
+ */
+  shm_object obj;
+  unsigned long long off, phys, *bucket, slot, oldest = 0;
+  int w, way = -1, uriLength = strlen(uri), respLength = strlen(response);
+
+  obj.gzip = header_has_token(response, "Content-Encoding:", "gzip");
+  obj.vary = header_has_token(response, "Vary:", "Accept-Encoding");
+  obj.key = shm_key(uri, obj.gzip);
+  obj.uriLength = uriLength;
+  obj.respLength = respLength;
+  obj.contentLength = contentLength;
+  obj.size = (sizeof(obj) + uriLength + respLength + 2 + contentLength + 7) & ~7;
+  if (uriLength >= URI_SIZE || respLength >= RESP_SIZE || obj.size > (*cache).size / 4)
+  {
+    return 0;
+  }
+
+  P(&(*cache).mutex);
+
+  /// records do not wrap: skip the rest of the arena if it is too short
+  off = (*cache).tail;
+  phys = off % (*cache).size;
+  if (phys + obj.size > (*cache).size)
+    off += (*cache).size - phys;
+  store_release(&(*cache).tail, off + obj.size);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  char *p = (*cache).arena + off % (*cache).size;
+  memcpy(p, &obj, sizeof(obj));
+  memcpy(p + sizeof(obj), uri, uriLength + 1);
+  memcpy(p + sizeof(obj) + uriLength + 1, response, respLength + 1);
+  memcpy(p + sizeof(obj) + uriLength + respLength + 2, content, contentLength);
+
+  /// index it in place of the same object, an evicted one or the oldest
+  bucket = (*cache).slots[obj.key % SHM_BUCKETS];
+  for (w = 0; w < SHM_WAYS; w++)
+  {
+    slot = bucket[w];
+    if (slot == 0 || !shm_valid(cache, slot - 1) ||
+        (*(shm_object *)((*cache).arena + (slot - 1) % (*cache).size)).key == obj.key)
+    {
+      way = w;
+      break;
+    }
+    if (way < 0 || slot < oldest)
+    {
+      way = w;
+      oldest = slot;
+    }
+  }
+  store_release(&bucket[way], off + 1);
+  (*cache).stores++;
+
+  V(&(*cache).mutex);
+  return 1;
+}
+
+// free a block returned by shm_cache_find()
+void shm_block_free(cache_block *block)
+{
+  free((*block).content);
+  free(block);
+}
+
+int shm_cache_stats(shm_cache *cache, char *buf, int size)
+{
+/*
+ * shm_cache_stats:
+ *        write a plain text report of the shared cache
+ * return: length of the report
+ */
+  long hits = (*cache).hits, misses = (*cache).misses;
+  int b, w, objects = 0, n;
+
+  for (b = 0; b < SHM_BUCKETS; b++)
+    for (w = 0; w < SHM_WAYS; w++)
+      if ((*cache).slots[b][w] != 0 && shm_valid(cache, (*cache).slots[b][w] - 1))
+        objects++;
+
+  n = snprintf(buf, size,
+               "shared cache of %llu bytes, %d objects, %ld stored since start\n"
+               "hits %ld misses %ld hit ratio %.4f\n",
+               (*cache).size, objects, (*cache).stores,
+               hits, misses, hits + misses ? (double)hits / (hits + misses) : 0);
+  return n < size ? n : size - 1;
+}
@@ -0,0 +1,50 @@
+/*
+ * shmcache.h - proxy cache shared by forked worker processes (proxy -P)
+ *
+ * One shared mapping, created before the workers are forked, holds a hash
+ * index and a log-structured object arena. Objects are appended at the
+ * tail of the arena, which wraps around and overwrites the oldest ones,
+ * so eviction is FIFO and needs no bookkeeping. Readers take no lock:
+ * they copy an object out and then check that the tail did not advance
+ * over it meanwhile (a seqlock on the log position). Writers are
+ * serialized by a process-shared semaphore.
+ */
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define SHM_BUCKETS 4096          // index buckets
+#define SHM_WAYS 4                // objects per bucket
+
+/// an object in the arena, followed by its uri, response header and body
+typedef struct {
+	unsigned long long key;       // hash of the uri and the variant
+	int uriLength;
+	int respLength;
+	int contentLength;
+	char gzip;
+	char vary;
+	int size;                     // whole record, 8-byte aligned
+} shm_object;
+
+typedef struct {
+	unsigned long long tail;      // log position of the next record
+	unsigned long long size;      // bytes in the arena
+	unsigned long long slots[SHM_BUCKETS][SHM_WAYS];  // log position + 1, 0: empty
+	long hits;
+	long misses;
+	long stores;
+	sem_t mutex;                  // serializes writers
+	char arena[];
+} shm_cache;
+
+shm_cache* shm_cache_init(int size);
+cache_block* shm_cache_find(shm_cache* cache, char* uri, int acceptGzip);
+int shm_cache_has(shm_cache* cache, char* uri);
+int shm_cache_add(shm_cache* cache, char* uri, char* content, char* response, int contentLength);
+void shm_block_free(cache_block* block);
+int shm_cache_stats(shm_cache* cache, char* buf, int size);
+
+#endif /* __SHMCACHE_H__ */
@@ -0,0 +1,91 @@
+#include "timerwheel.h"
+#include <string.h>
+
+// ticks since the wheel was started
+static long tw_ticks(tw_wheel *wheel)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - (*wheel).start.tv_sec) * 1000 +
+          (now.tv_nsec - (*wheel).start.tv_nsec) / 1000000) / (*wheel).tick_ms;
+}
+
+void tw_init(tw_wheel *wheel, int tickMs)
+{
+/*
+ * tw_init:
+ *        an empty wheel that advances every tickMs milliseconds
+ */
+  memset(wheel, 0, sizeof(tw_wheel));
+  (*wheel).tick_ms = tickMs;
+  clock_gettime(CLOCK_MONOTONIC, &(*wheel).start);
+}
+
+void tw_add(tw_wheel *wheel, tw_timer *timer, int ms)
+{
+/*
+ * tw_add:
+ *        arms timer to fire in ms milliseconds (at least one tick), moving
+ *        it if it is armed already
+ */
+  tw_timer **slot;
+  long ticks = (ms + (*wheel).tick_ms - 1) / (*wheel).tick_ms;
+
+  if ((*timer).pending)
+    tw_cancel(wheel, timer);
+  (*timer).expires = tw_ticks(wheel) + (ticks > 0 ? ticks : 1);
+  if ((*timer).expires <= (*wheel).now)
+    (*timer).expires = (*wheel).now + 1;
+  slot = &(*wheel).slots[(*timer).expires % TW_SLOTS];
+  (*timer).prev = NULL;
+  (*timer).next = *slot;
+  if (*slot != NULL)
+    (**slot).prev = timer;
+  *slot = timer;
+  (*timer).pending = 1;
+}
+
+// disarm timer; nothing happens if it is not armed
+void tw_cancel(tw_wheel *wheel, tw_timer *timer)
+{
+  if (!(*timer).pending)
+    return;
+  if ((*timer).prev != NULL)
+    (*(*timer).prev).next = (*timer).next;
+  else
+    (*wheel).slots[(*timer).expires % TW_SLOTS] = (*timer).next;
+  if ((*timer).next != NULL)
+    (*(*timer).next).prev = (*timer).prev;
+  (*timer).pending = 0;
+}
+
+void tw_advance(tw_wheel *wheel, void (*expire)(tw_timer *timer))
+{
+/*
+ * tw_advance:
+ *        processes the ticks up to the current time and calls expire for
+ *        every timer that came due; expire may arm and cancel timers
+ */
+  long target = tw_ticks(wheel);
+  tw_timer *timer;
+
+  while ((*wheel).now < target)
+  {
+    (*wheel).now++;
+    timer = (*wheel).slots[(*wheel).now % TW_SLOTS];
+    while (timer != NULL)
+    {
+      if ((*timer).expires > (*wheel).now)
+      {
+        timer = (*timer).next;
+        continue;
+      }
+
+      /// the callback may change the slot: start over after each timer
+      tw_cancel(wheel, timer);
+      expire(timer);
+      timer = (*wheel).slots[(*wheel).now % TW_SLOTS];
+    }
+  }
+}
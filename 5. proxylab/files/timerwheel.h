@@ -0,0 +1,37 @@
+/*
+ * timerwheel.h - hashed timer wheel for connection deadlines
+ *
+ * A timer hangs in the slot of its expiry tick modulo TW_SLOTS; one due
+ * more than a turn of the wheel ahead stays in its slot until the wheel
+ * comes around to its tick. Arming and cancelling are O(1), and every
+ * tick only looks at one slot, so tens of thousands of connections with
+ * deadlines cost next to nothing while the deadlines do not fire.
+ */
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <time.h>
+
+#define TW_SLOTS 512
+
+typedef struct tw_timer {
+	long expires;               // tick at which the timer fires
+	char pending;               // armed and not yet fired or cancelled
+	void *data;                 // owner of the timer
+	struct tw_timer *prev;
+	struct tw_timer *next;
+} tw_timer;
+
+typedef struct {
+	tw_timer *slots[TW_SLOTS];
+	long now;                   // last tick processed
+	int tick_ms;
+	struct timespec start;      // time of tick 0
+} tw_wheel;
+
+void tw_init(tw_wheel *wheel, int tickMs);
+void tw_add(tw_wheel *wheel, tw_timer *timer, int ms);
+void tw_cancel(tw_wheel *wheel, tw_timer *timer);
+void tw_advance(tw_wheel *wheel, void (*expire)(tw_timer *timer));
+
+#endif /* __TIMERWHEEL_H__ */
@@ -0,0 +1,211 @@
+#include "uring.h"
+#include <sys/syscall.h>
+
+/// the ring indices are shared with the kernel: loads of what the kernel
+/// writes acquire, stores of what it reads release
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int uring_init(uring_t *ring, unsigned entries)
+{
+/*
+ * uring_init:
+ *        creates a ring with room for entries submissions and maps its
+ *        submission queue, completion queue and entry array
+ * return: 0 on success, -1 with errno set (e.g. io_uring not supported)
+ */
+  struct io_uring_params p;
+  char *sq, *cq;
+  int err;
+
+  memset(ring, 0, sizeof(uring_t));
+  memset(&p, 0, sizeof(p));
+  if (((*ring).fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return -1;
+
+  (*ring).sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  (*ring).cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if ((*ring).cq_ring_size > (*ring).sq_ring_size)
+      (*ring).sq_ring_size = (*ring).cq_ring_size;
+    (*ring).cq_ring_size = (*ring).sq_ring_size;
+  }
+
+  (*ring).sq_ring = mmap(NULL, (*ring).sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, (*ring).fd, IORING_OFF_SQ_RING);
+  if ((*ring).sq_ring == MAP_FAILED)
+    goto fail_sq;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    (*ring).cq_ring = (*ring).sq_ring;
+  else if (((*ring).cq_ring = mmap(NULL, (*ring).cq_ring_size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, (*ring).fd,
+                                   IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto fail_cq;
+  (*ring).sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, (*ring).fd, IORING_OFF_SQES);
+  if ((*ring).sqes == MAP_FAILED)
+    goto fail_sqes;
+
+  sq = (*ring).sq_ring;
+  (*ring).sq_head = (unsigned *)(sq + p.sq_off.head);
+  (*ring).sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  (*ring).sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  (*ring).sq_array = (unsigned *)(sq + p.sq_off.array);
+  (*ring).sq_entries = p.sq_entries;
+  cq = (*ring).cq_ring;
+  (*ring).cq_head = (unsigned *)(cq + p.cq_off.head);
+  (*ring).cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  (*ring).cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  (*ring).cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+
+  /// undo the mappings made so far and close the ring, keeping errno
+fail_sqes:
+  if ((*ring).cq_ring != (*ring).sq_ring)
+    munmap((*ring).cq_ring, (*ring).cq_ring_size);
+fail_cq:
+  munmap((*ring).sq_ring, (*ring).sq_ring_size);
+fail_sq:
+  err = errno;
+  close((*ring).fd);
+  errno = err;
+  return -1;
+}
+
+// register n buffers for the *_fixed operations
+int uring_register_buffers(uring_t *ring, struct iovec *iov, unsigned n)
+{
+  return syscall(__NR_io_uring_register, (*ring).fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+/*
+ * uring_get_sqe:
+ *        a cleared submission entry, queued at the next submit
+ * return: NULL if the submission queue is full
+ */
+  unsigned tail = *(*ring).sq_tail + (*ring).queued;
+  struct io_uring_sqe *sqe;
+
+  if (tail - load_acquire((*ring).sq_head) >= (*ring).sq_entries)
+    return NULL;
+  sqe = &(*ring).sqes[tail & *(*ring).sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  (*ring).sq_array[tail & *(*ring).sq_mask] = tail & *(*ring).sq_mask;
+  (*ring).queued++;
+  return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned wait)
+{
+/*
+ * uring_submit_and_wait:
+ *        submits the queued entries and waits for at least wait completions
+ * return: number of entries submitted, -1 on error
+ */
+  unsigned submit = (*ring).queued;
+  int rc;
+
+  store_release((*ring).sq_tail, *(*ring).sq_tail + submit);
+  (*ring).queued = 0;
+  while ((rc = syscall(__NR_io_uring_enter, (*ring).fd, submit, wait,
+                       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0 && errno == EINTR)
+    submit = 0;
+  return rc;
+}
+
+// the oldest unseen completion, NULL if none
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+  unsigned head = *(*ring).cq_head;
+
+  if (head == load_acquire((*ring).cq_tail))
+    return NULL;
+  return &(*ring).cqes[head & *(*ring).cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+  store_release((*ring).cq_head, *(*ring).cq_head + 1);
+}
+
+//-----------------------------------------------------------------------------
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, void *data)
+{
+  (*sqe).opcode = IORING_OP_ACCEPT;
+  (*sqe).fd = fd;
+  (*sqe).user_data = (unsigned long)data;
+}
+
+void uring_prep_connect(struct io_uring_sqe *sqe, int fd, struct sockaddr *addr,
+                        socklen_t addrlen, void *data)
+{
+  (*sqe).opcode = IORING_OP_CONNECT;
+  (*sqe).fd = fd;
+  (*sqe).addr = (unsigned long)addr;
+  (*sqe).off = addrlen;
+  (*sqe).user_data = (unsigned long)data;
+}
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned n,
+                           int index, void *data)
+{
+  (*sqe).opcode = IORING_OP_READ_FIXED;
+  (*sqe).fd = fd;
+  (*sqe).addr = (unsigned long)buf;
+  (*sqe).len = n;
+  (*sqe).buf_index = index;
+  (*sqe).user_data = (unsigned long)data;
+}
+
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned n,
+                            int index, void *data)
+{
+  (*sqe).opcode = IORING_OP_WRITE_FIXED;
+  (*sqe).fd = fd;
+  (*sqe).addr = (unsigned long)buf;
+  (*sqe).len = n;
+  (*sqe).buf_index = index;
+  (*sqe).user_data = (unsigned long)data;
+}
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, unsigned n, void *data)
+{
+  (*sqe).opcode = IORING_OP_RECV;
+  (*sqe).fd = fd;
+  (*sqe).addr = (unsigned long)buf;
+  (*sqe).len = n;
+  (*sqe).user_data = (unsigned long)data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, void *buf, unsigned n, void *data)
+{
+  (*sqe).opcode = IORING_OP_SEND;
+  (*sqe).fd = fd;
+  (*sqe).addr = (unsigned long)buf;
+  (*sqe).len = n;
+  (*sqe).msg_flags = MSG_NOSIGNAL;
+  (*sqe).user_data = (unsigned long)data;
+}
+
+// complete (with -ETIME) once *ts has passed
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts, void *data)
+{
+  (*sqe).opcode = IORING_OP_TIMEOUT;
+  (*sqe).fd = -1;
+  (*sqe).addr = (unsigned long)ts;
+  (*sqe).len = 1;
+  (*sqe).user_data = (unsigned long)data;
+}
+
+// cancel the first operation submitted with data target, which completes
+// with -ECANCELED; one at a time, since IORING_ASYNC_CANCEL_ALL needs
+// Linux 5.19
+void uring_prep_cancel(struct io_uring_sqe *sqe, void *target, void *data)
+{
+  (*sqe).opcode = IORING_OP_ASYNC_CANCEL;
+  (*sqe).fd = -1;
+  (*sqe).addr = (unsigned long)target;
+  (*sqe).user_data = (unsigned long)data;
+}
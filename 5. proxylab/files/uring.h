@@ -0,0 +1,47 @@
+/*
+ * uring.h - minimal io_uring wrapper for the proxy's event engine
+ *
+ * Sets up a submission/completion ring pair with the raw system calls
+ * (no liburing), hands out submission entries, registers fixed buffers
+ * and reaps completions. Every operation of one submission batch costs a
+ * single io_uring_enter() call.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "csapp.h"
+#include <linux/io_uring.h>
+
+typedef struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	unsigned queued;            // entries filled but not yet submitted
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+int uring_register_buffers(uring_t *ring, struct iovec *iov, unsigned n);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+int uring_submit_and_wait(uring_t *ring, unsigned wait);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+/// prepare a submission entry; data comes back in the completion
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, void *data);
+void uring_prep_connect(struct io_uring_sqe *sqe, int fd, struct sockaddr *addr,
+                        socklen_t addrlen, void *data);
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned n,
+                           int index, void *data);
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned n,
+                            int index, void *data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, unsigned n, void *data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, void *buf, unsigned n, void *data);
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts, void *data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, void *target, void *data);
+
+#endif /* __URING_H__ */